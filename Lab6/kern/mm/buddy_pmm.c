@@ -0,0 +1,265 @@
+#include <pmm.h>
+#include <list.h>
+#include <string.h>
+#include <stdio.h>
+#include <buddy_pmm.h>
+
+/* The buddy system keeps one free list per order. A free block of order k
+ * is 2^k pages long and its first page number (ppn) is a multiple of 2^k.
+ * Only the head page of a free block is linked in buddy_area[k]; it has
+ * PG_property set and property == k. The other pages of the block are left
+ * untouched, so neither allocation nor free ever walks a block page by page.
+ *
+ * alloc_pages(n): take the smallest non-empty list of order >= order(n),
+ *                 split the block in halves until it has order(n), and give
+ *                 back the unused tail [n, 2^order(n)) to the free lists.
+ * free_pages(base, n): cut [base, base+n) into aligned power-of-two blocks
+ *                 and free each of them, merging it with its buddy
+ *                 (ppn ^ 2^k) as long as the buddy is a free block of the
+ *                 same order.
+ *
+ * Both operations cost O(BUDDY_MAX_ORDER) list operations, no matter how
+ * much memory is free or how fragmented it is.
+ *
+ * Blocks are aligned by their index in pages[] rather than by ppn. The
+ * memmap is sparse, but every section has an aligned chunk of pages[], and
+ * a block is never bigger than a section, so both give the same blocks.
+ */
+
+static free_area_t buddy_area[BUDDY_MAX_ORDER];
+static size_t buddy_nr_free;
+
+#define buddy_list(order)       (buddy_area[(order)].free_list)
+#define buddy_nr(order)         (buddy_area[(order)].nr_free)
+
+// buddy_order - the smallest order whose block can hold n pages
+static inline unsigned int
+buddy_order(size_t n) {
+    unsigned int order = 0;
+    while (((size_t)1 << order) < n) {
+        order ++;
+    }
+    return order;
+}
+
+static inline void
+buddy_push(struct Page *page, unsigned int order) {
+    page->property = order;
+    SetPageProperty(page);
+    list_add(&buddy_list(order), &(page->page_link));
+    buddy_nr(order) ++;
+}
+
+static inline void
+buddy_pop(struct Page *page, unsigned int order) {
+    list_del(&(page->page_link));
+    ClearPageProperty(page);
+    page->property = 0;
+    buddy_nr(order) --;
+}
+
+// buddy_free_block - give back an aligned 2^order block and coalesce it
+static void
+buddy_free_block(struct Page *page, unsigned int order) {
+    size_t idx = page - pages;
+    while (order < BUDDY_MAX_ORDER - 1) {
+        size_t buddy_idx = idx ^ ((size_t)1 << order);
+        if (buddy_idx >= nr_memmap) {
+            break;
+        }
+        struct Page *buddy = pages + buddy_idx;
+        if (!PageProperty(buddy) || buddy->property != order) {
+            break;
+        }
+        buddy_pop(buddy, order);
+        idx &= ~((size_t)1 << order);
+        order ++;
+    }
+    buddy_push(pages + idx, order);
+}
+
+// buddy_free_range - cut [base, base + n) into the largest aligned blocks
+static void
+buddy_free_range(struct Page *base, size_t n) {
+    size_t idx = base - pages, end = idx + n;
+    while (idx < end) {
+        unsigned int order = 0;
+        while (order < BUDDY_MAX_ORDER - 1
+               && (idx & ((size_t)1 << order)) == 0
+               && idx + ((size_t)2 << order) <= end) {
+            order ++;
+        }
+        buddy_free_block(pages + idx, order);
+        idx += (size_t)1 << order;
+    }
+}
+
+static void
+buddy_init(void) {
+    static_assert(BUDDY_MAX_ORDER - 1 <= SECTION_PAGE_SHIFT);
+    int i;
+    for (i = 0; i < BUDDY_MAX_ORDER; i ++) {
+        list_init(&buddy_list(i));
+        buddy_nr(i) = 0;
+    }
+    buddy_nr_free = 0;
+}
+
+static void
+buddy_init_memmap(struct Page *base, size_t n) {
+    assert(n > 0);
+    struct Page *p = base;
+    for (; p != base + n; p ++) {
+        assert(PageReserved(p));
+        p->flags = p->property = 0;
+        set_page_ref(p, 0);
+    }
+    buddy_free_range(base, n);
+    buddy_nr_free += n;
+}
+
+static struct Page *
+buddy_alloc_pages(size_t n) {
+    assert(n > 0);
+    if (n > buddy_nr_free) {
+        return NULL;
+    }
+    unsigned int order = buddy_order(n), cur = order;
+    if (order >= BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    while (cur < BUDDY_MAX_ORDER && list_empty(&buddy_list(cur))) {
+        cur ++;
+    }
+    if (cur == BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    struct Page *page = le2page(list_next(&buddy_list(cur)), page_link);
+    buddy_pop(page, cur);
+    // keep the lower half, hand the upper half back one order down
+    while (cur > order) {
+        cur --;
+        buddy_push(page + ((size_t)1 << cur), cur);
+    }
+    size_t size = (size_t)1 << order;
+    if (size > n) {
+        buddy_free_range(page + n, size - n);
+    }
+    buddy_nr_free -= n;
+    return page;
+}
+
+static void
+buddy_free_pages(struct Page *base, size_t n) {
+    assert(n > 0);
+    struct Page *p = base;
+    for (; p != base + n; p ++) {
+        assert(!PageReserved(p) && !PageProperty(p));
+        p->flags = 0;
+        set_page_ref(p, 0);
+    }
+    buddy_free_range(base, n);
+    buddy_nr_free += n;
+}
+
+static size_t
+buddy_nr_free_pages(void) {
+    return buddy_nr_free;
+}
+
+static void
+buddy_check(void) {
+    int i, count = 0;
+    size_t total = 0;
+    for (i = 0; i < BUDDY_MAX_ORDER; i ++) {
+        list_entry_t *le = &buddy_list(i);
+        while ((le = list_next(le)) != &buddy_list(i)) {
+            struct Page *p = le2page(le, page_link);
+            assert(PageProperty(p) && p->property == i);
+            assert(page2ppn(p) % (1 << i) == 0);
+            count ++, total += (1 << i);
+        }
+    }
+    assert(total == nr_free_pages());
+
+    // a kernel stack is an aligned order-1 block
+    struct Page *p0, *p1, *p2, *p3;
+    assert((p0 = alloc_pages(KSTACKPAGE)) != NULL);
+    assert(page2ppn(p0) % KSTACKPAGE == 0);
+    free_pages(p0, KSTACKPAGE);
+
+    // take an order-4 block and run the split/merge checks on its lower
+    // half alone, the upper half stays allocated so nothing merges past it
+    assert((p0 = alloc_pages(16)) != NULL);
+    assert(page2ppn(p0) % 16 == 0 && !PageProperty(p0));
+
+    free_area_t area_store[BUDDY_MAX_ORDER];
+    size_t nr_free_store = buddy_nr_free;
+    for (i = 0; i < BUDDY_MAX_ORDER; i ++) {
+        area_store[i] = buddy_area[i];
+    }
+    buddy_init();
+    assert(alloc_page() == NULL);
+
+    free_pages(p0, 8);
+    assert(buddy_nr_free == 8 && buddy_nr(3) == 1);
+    assert(PageProperty(p0) && p0->property == 3);
+
+    // 8 -> 1 + 1 + 2 + 4
+    assert((p1 = alloc_page()) == p0);
+    assert(buddy_nr(0) == 1 && buddy_nr(1) == 1 && buddy_nr(2) == 1 && buddy_nr(3) == 0);
+    assert((p2 = alloc_pages(2)) == p0 + 2);
+    // an odd size takes an order-2 block and gives back its last page
+    assert((p3 = alloc_pages(3)) == p0 + 4);
+    assert(PageProperty(p0 + 7) && p0[7].property == 0);
+    assert(buddy_nr_free == 2);
+    assert(alloc_pages(2) == NULL);
+
+    // freeing everything must coalesce back into one order-3 block
+    free_page(p1);
+    assert(buddy_nr(0) == 1 && buddy_nr(1) == 1);
+    assert(PageProperty(p0) && p0->property == 1);
+    free_pages(p3, 3);
+    assert(buddy_nr(2) == 1 && PageProperty(p0 + 4) && p0[4].property == 2);
+    free_pages(p2, 2);
+    assert(buddy_nr_free == 8 && buddy_nr(3) == 1);
+    assert(PageProperty(p0) && p0->property == 3);
+
+    // freeing a range that is not a power of two
+    assert((p1 = alloc_pages(8)) == p0);
+    free_pages(p0 + 1, 6);
+    assert(buddy_nr(0) == 2 && buddy_nr(1) == 2 && buddy_nr_free == 6);
+    free_page(p0);
+    free_page(p0 + 7);
+    assert(buddy_nr_free == 8 && buddy_nr(3) == 1);
+
+    assert((p0 = alloc_pages(8)) != NULL);
+    assert(alloc_page() == NULL);
+    assert(buddy_nr_free == 0);
+
+    for (i = 0; i < BUDDY_MAX_ORDER; i ++) {
+        buddy_area[i] = area_store[i];
+    }
+    buddy_nr_free = nr_free_store;
+    free_pages(p0, 16);
+
+    for (i = 0; i < BUDDY_MAX_ORDER; i ++) {
+        list_entry_t *le = &buddy_list(i);
+        while ((le = list_next(le)) != &buddy_list(i)) {
+            count --, total -= (1 << i);
+        }
+    }
+    assert(count == 0);
+    assert(total == 0);
+}
+
+const struct pmm_manager buddy_pmm_manager = {
+    .name = "buddy_pmm_manager",
+    .init = buddy_init,
+    .init_memmap = buddy_init_memmap,
+    .alloc_pages = buddy_alloc_pages,
+    .free_pages = buddy_free_pages,
+    .nr_free_pages = buddy_nr_free_pages,
+    .check = buddy_check,
+};
+
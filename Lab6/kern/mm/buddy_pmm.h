@@ -0,0 +1,13 @@
+#ifndef __KERN_MM_BUDDY_PMM_H__
+#define  __KERN_MM_BUDDY_PMM_H__
+
+#include <pmm.h>
+
+// free blocks are kept in lists of order 0 .. BUDDY_MAX_ORDER - 1,
+// so the biggest block the buddy system hands out is 2^(BUDDY_MAX_ORDER-1) pages
+#define BUDDY_MAX_ORDER             11
+
+extern const struct pmm_manager buddy_pmm_manager;
+
+#endif /* ! __KERN_MM_BUDDY_PMM_H__ */
+
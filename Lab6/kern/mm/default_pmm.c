@@ -120,6 +120,7 @@ default_alloc_pages(size_t n) {
         nr_free -= n;//空闲总页数-n
         //re-caluclate nr_free (number of the the rest of all free block)
         ClearPageProperty(page);//清空当前页property
+        page->property = 0;//property与ref共用空间，已分配页的ref应为0
         SetPageReserved(page);//设置当前页为保留页
     }
     return page;//返回page（值为NULL或p）
@@ -125,19 +125,27 @@ struct e820map {
  * struct Page - Page descriptor structures. Each Page describes one
  * physical page. In kern/mm/pmm.h, you can find lots of useful functions
  * that convert Page to other data types, such as phyical address.
+ * A page is either free (in a pmm_manager or the page cache) or allocated,
+ * so the fields of the two states share unions. The bits of flags above
+ * PGSHIFT keep the pra_vaddr of a swappable page, which is page aligned.
+ * This keeps struct Page at 16 bytes, and page2ppn is a shift.
  * */
 struct Page {
-    int ref;                        // page frame's reference counter
-    uint32_t flags;                 // array of flags that describe the status of the page frame
-    unsigned int property;          // the num of free block, used in first fit pm manager
-    list_entry_t page_link;         // free list link
-    list_entry_t pra_page_link;     // used for pra (page replace algorithm)
-    uintptr_t pra_vaddr;            // used for pra (page replace algorithm)
+    union {
+        int ref;                    // allocated page: page frame's reference counter
+        unsigned int property;      // free page: the num of free block, used in first fit pm manager
+    };
+    uint32_t flags;                 // array of flags that describe the status of the page frame, and pra_vaddr
+    union {
+        list_entry_t page_link;     // free page: free list link
+        list_entry_t pra_page_link; // swappable page: used for pra (page replace algorithm)
+    };
 };
 
-/* Flags describing the status of a page frame */
+/* Flags describing the status of a page frame, all of them below PGSHIFT */
 #define PG_reserved                 0       // if this bit=1: the Page is reserved for kernel, cannot be used in alloc/free_pages; otherwise, this bit=0 
 #define PG_property                 1       // if this bit=1: the Page is the head page of a free memory block(contains some continuous_addrress pages), and can be used in alloc_pages; if this bit=0: if the Page is the the head page of a free memory block, then this Page and the memory block is alloced. Or this Page isn't the head page.
+#define PG_swappable                2       // if this bit=1: the Page is linked in the swap manager's list of its mm by pra_page_link, and can be swapped out
 
 #define SetPageReserved(page)       set_bit(PG_reserved, &((page)->flags))
 #define ClearPageReserved(page)     clear_bit(PG_reserved, &((page)->flags))
@@ -145,6 +153,9 @@ struct Page {
 #define SetPageProperty(page)       set_bit(PG_property, &((page)->flags))
 #define ClearPageProperty(page)     clear_bit(PG_property, &((page)->flags))
 #define PageProperty(page)          test_bit(PG_property, &((page)->flags))
+#define SetPageSwappable(page)      set_bit(PG_swappable, &((page)->flags))
+#define ClearPageSwappable(page)    clear_bit(PG_swappable, &((page)->flags))
+#define PageSwappable(page)         test_bit(PG_swappable, &((page)->flags))
 
 // convert list entry to page
 #define le2page(le, member)                 \
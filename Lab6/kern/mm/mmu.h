@@ -218,6 +218,7 @@ struct taskstate {
 // address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uintptr_t)(pte) & ~0xFFF)
 #define PDE_ADDR(pde)   PTE_ADDR(pde)
+#define PDE_PS_ADDR(pde) ((uintptr_t)(pde) & ~(PTSIZE - 1)) // 4MB page in a PDE with PTE_PS set
 
 /* page directory and page table constants */
 #define NPDEENTRY       1024                    // page directory entries per page directory
@@ -6,11 +6,15 @@
 #include <memlayout.h>
 #include <pmm.h>
 #include <default_pmm.h>
+#include <buddy_pmm.h>
+#include <tlsf_pmm.h>
 #include <sync.h>
 #include <error.h>
 #include <swap.h>
 #include <vmm.h>
 #include <kmalloc.h>
+#include <proc.h>
+#include <rmap.h>
 
 /* *
  * Task State Segment:
@@ -36,8 +40,26 @@ static struct taskstate ts = {0};
 
 // virtual address of physicall page array
 struct Page *pages;
+// page_anon[i] is the anon_vma of pages[i] (see rmap.h), kept apart so struct Page stays 16 bytes
+struct anon_vma **page_anon;
 // amount of physical memory (in pages)
 size_t npage = 0;
+// # of struct Page in pages[], only the sections with memory have them
+size_t nr_memmap = 0;
+// section number <-> place in pages[], see pmm.h
+uint16_t section_index[NR_SECTIONS];
+uint16_t section_nr[NR_SECTIONS];
+
+// page_init inits the sections up to MEMMAP_EARLY_SIZE above the kernel, that's
+// enough to boot. The others are deferred: memmap_init_main inits them one by one
+// in the background, or alloc_pages does it when it runs out of free pages.
+#define MEMMAP_EARLY_SIZE           (16 * 1024 * 1024)
+
+static uint64_t memmap_freemem, memmap_maxpa;
+static size_t memmap_next;      // the next deferred section (place in pages[])
+static bool memmap_lazy = 0;    // alloc_pages may init deferred sections, not while boot checks run
+
+static bool memmap_init_next(void);
 
 // virtual address of boot-time page directory
 pde_t *boot_pgdir = NULL;
@@ -47,6 +69,10 @@ uintptr_t boot_cr3;
 // physical memory management
 const struct pmm_manager *pmm_manager;
 
+// free page watermarks: kswapd is woken up below low_free_pages and reclaims
+// up to high_free_pages, an allocation below min_free_pages reclaims by itself
+size_t min_free_pages, low_free_pages, high_free_pages;
+
 /* *
  * The page directory entry corresponding to the virtual address range
  * [VPT, VPT + PTSIZE) points to the page directory itself. Thus, the page
@@ -90,9 +116,42 @@ static struct pseudodesc gdt_pd = {
 };
 
 static void check_alloc_page(void);
+static void check_alloc_latency(void);
+static void check_page_cache(void);
+static void check_zero_pool(void);
 static void check_pgdir(void);
 static void check_boot_pgdir(void);
 
+// the KERNBASE map is built from 4MB pages if the CPU has PSE
+static bool pse_on = 0;
+
+#define CPUID_PSE                   0x00000008  // cpuid(1).edx: Page Size Extensions
+
+static inline bool
+cpu_has_pse(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    return (edx & CPUID_PSE) != 0;
+}
+
+//pse_enabled - CR4.PSE is set, so the MMU takes a PDE with PTE_PS for a 4MB page
+bool
+pse_enabled(void) {
+    return pse_on;
+}
+
+static inline uintptr_t
+rcr4(void) {
+    uintptr_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4) :: "memory");
+    return cr4;
+}
+
+static inline void
+lcr4(uintptr_t cr4) {
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
 /* *
  * lgdt - load the global descriptor table register and reset the
  * data/code segement registers for kernel.
@@ -137,9 +196,29 @@ gdt_init(void) {
 }
 
 //init_pmm_manager - initialize a pmm_manager instance
+//                 - the buddy system is the default, build with -DPMM_FIRST_FIT to get
+//                 - first fit back or with -DPMM_TLSF to get the two-level segregated fit
+//init_watermarks - set the free page watermarks from the # of free pages after page_init
+static void
+init_watermarks(void) {
+    min_free_pages = nr_free_pages() / 256;
+    if (min_free_pages < 16) {
+        min_free_pages = 16;
+    }
+    low_free_pages = min_free_pages + min_free_pages / 4;
+    high_free_pages = min_free_pages + min_free_pages / 2;
+    cprintf("free page watermarks: min %d, low %d, high %d\n", min_free_pages, low_free_pages, high_free_pages);
+}
+
 static void
 init_pmm_manager(void) {
+#if defined(PMM_FIRST_FIT)
     pmm_manager = &default_pmm_manager;
+#elif defined(PMM_TLSF)
+    pmm_manager = &tlsf_pmm_manager;
+#else
+    pmm_manager = &buddy_pmm_manager;
+#endif
     cprintf("memory management: %s\n", pmm_manager->name);
     pmm_manager->init();
 }
@@ -150,6 +229,135 @@ init_memmap(struct Page *base, size_t n) {
     pmm_manager->init_memmap(base, n);
 }
 
+/* *
+ * Order-0 page cache
+ *
+ * Most allocations are single pages (page tables, fault pages, fork copies),
+ * so a small cache of free pages sits in front of pmm_manager for them:
+ *   hot_list:  pages freed recently, probably still in the CPU cache. It is
+ *              a LIFO stack, the most recently freed page is reused first.
+ *   cold_list: pages refilled from pmm_manager, PCP_BATCH at a time, which
+ *              nobody has touched lately. Only used when hot_list is empty.
+ * When the cache holds more than PCP_HIGH pages, PCP_BATCH of the coldest
+ * ones are given back to pmm_manager in one go. Multi-page requests go
+ * straight to pmm_manager; if that fails the cache is drained and the
+ * request retried, so cached pages can still be merged into bigger blocks.
+ * */
+#define PCP_BATCH                   16
+#define PCP_HIGH                    64
+
+static struct page_cache {
+    list_entry_t hot_list;          // recently freed pages, most recent first
+    list_entry_t cold_list;         // pages refilled from pmm_manager
+    size_t nr_hot;                  // # of pages in hot_list
+    size_t nr_cold;                 // # of pages in cold_list
+    bool enabled;                   // set after the pmm_manager checks have run
+} pcp;
+
+static void
+page_cache_init(void) {
+    list_init(&(pcp.hot_list));
+    list_init(&(pcp.cold_list));
+    pcp.nr_hot = pcp.nr_cold = 0;
+    pcp.enabled = 0;
+}
+
+// page_cache_release - give up to n of the coldest cached pages back to pmm_manager
+static void
+page_cache_release(size_t n) {
+    while (n -- > 0) {
+        list_entry_t *le;
+        if (pcp.nr_cold > 0) {
+            le = list_prev(&(pcp.cold_list));
+            pcp.nr_cold --;
+        }
+        else if (pcp.nr_hot > 0) {
+            le = list_prev(&(pcp.hot_list));
+            pcp.nr_hot --;
+        }
+        else {
+            break;
+        }
+        list_del(le);
+        pmm_manager->free_pages(le2page(le, page_link), 1);
+    }
+}
+
+static struct Page *
+page_cache_alloc(void) {
+    list_entry_t *le;
+    if (pcp.nr_hot > 0) {
+        le = list_next(&(pcp.hot_list));
+        pcp.nr_hot --;
+    }
+    else {
+        if (pcp.nr_cold == 0) {
+            struct Page *page;
+            while (pcp.nr_cold < PCP_BATCH && (page = pmm_manager->alloc_pages(1)) != NULL) {
+                list_add_before(&(pcp.cold_list), &(page->page_link));
+                pcp.nr_cold ++;
+            }
+            if (pcp.nr_cold == 0) {
+                return NULL;
+            }
+        }
+        le = list_next(&(pcp.cold_list));
+        pcp.nr_cold --;
+    }
+    list_del(le);
+    return le2page(le, page_link);
+}
+
+static void
+page_cache_free(struct Page *page) {
+    list_add(&(pcp.hot_list), &(page->page_link));
+    pcp.nr_hot ++;
+    if (pcp.nr_hot + pcp.nr_cold > PCP_HIGH) {
+        page_cache_release(PCP_BATCH);
+    }
+}
+
+/* *
+ * Pre-zeroed page pool
+ *
+ * Page tables, BSS pages and anonymous fault pages must all start out
+ * zeroed. Clearing 4KB on the fault or exec path is pure latency, so the
+ * idle thread clears free pages ahead of time and keeps up to ZERO_POOL_HIGH
+ * of them in zero_pool, where alloc_zeroed_page() finds them. Pool pages
+ * still count as free: alloc_pages takes them when everything else is gone,
+ * and gives them back to pmm_manager when it needs a bigger block.
+ * */
+#define ZERO_POOL_HIGH              32
+
+static list_entry_t zero_pool;
+static size_t nr_zero_pool;
+
+static void
+zero_pool_init(void) {
+    list_init(&zero_pool);
+    nr_zero_pool = 0;
+}
+
+static struct Page *
+zero_pool_alloc(void) {
+    if (nr_zero_pool == 0) {
+        return NULL;
+    }
+    list_entry_t *le = list_next(&zero_pool);
+    list_del(le);
+    nr_zero_pool --;
+    return le2page(le, page_link);
+}
+
+// zero_pool_release - give all the pool pages back to pmm_manager
+static void
+zero_pool_release(void) {
+    struct Page *page;
+    while ((page = zero_pool_alloc()) != NULL) {
+        pmm_manager->free_pages(page, 1);
+    }
+}
+
 //alloc_pages - call pmm->alloc_pages to allocate a continuous n*PAGESIZE memory 
 struct Page *
 alloc_pages(size_t n) {
@@ -160,15 +368,37 @@ alloc_pages(size_t n) {
     {
          local_intr_save(intr_flag);
          {
-              page = pmm_manager->alloc_pages(n);
+              if (n == 1 && pcp.enabled) {
+                  page = page_cache_alloc();
+              }
+              else if ((page = pmm_manager->alloc_pages(n)) == NULL && pcp.nr_hot + pcp.nr_cold > 0) {
+                  page_cache_release(pcp.nr_hot + pcp.nr_cold);
+                  page = pmm_manager->alloc_pages(n);
+              }
+              if (page == NULL && nr_zero_pool > 0) {
+                  if (n == 1) {
+                      page = zero_pool_alloc();
+                  }
+                  else {
+                      zero_pool_release();
+                      page = pmm_manager->alloc_pages(n);
+                  }
+              }
          }
          local_intr_restore(intr_flag);
 
-         if (page != NULL || n > 1 || swap_init_ok == 0) break;
+         if (page != NULL) break;
+         //init a deferred section of the memmap before reclaiming anything
+         if (memmap_lazy && memmap_init_next()) continue;
+         if (n > 1 || swap_init_ok == 0) break;
          
-         extern struct mm_struct *check_mm_struct;
-         //cprintf("page %x, call swap_out in alloc_pages %d\n",page, n);
-         swap_out(check_mm_struct, n, 0);
+         //no free page left, kswapd didn't keep up: reclaim right here,
+         //and give up if nothing can be swapped out
+         //cprintf("page %x, call swap_reclaim in alloc_pages %d\n",page, n);
+         if (swap_reclaim(n) == 0) break;
+    }
+    if (page != NULL && swap_init_ok) {
+         swap_balance(nr_free_pages());
     }
     //cprintf("n %d,get page %x, No %d in alloc_pages\n",n,page,(page-pages));
     return page;
@@ -180,25 +410,221 @@ free_pages(struct Page *base, size_t n) {
     bool intr_flag;
     local_intr_save(intr_flag);
     {
-        pmm_manager->free_pages(base, n);
+        if (n == 1 && pcp.enabled) {
+            page_cache_free(base);
+        }
+        else {
+            pmm_manager->free_pages(base, n);
+        }
+    }
+    local_intr_restore(intr_flag);
+}
+
+//alloc_pages_nowait - take n continuous pages from pmm_manager if it has them free
+//                   - right now: no page cache or zero_pool release, no deferred
+//                   - memmap section init and no reclaim, for callers that fall back
+//                   - to smaller allocations themselves (huge_fault).
+struct Page *
+alloc_pages_nowait(size_t n) {
+    struct Page *page;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        page = pmm_manager->alloc_pages(n);
+    }
+    local_intr_restore(intr_flag);
+    if (page != NULL && swap_init_ok) {
+        swap_balance(nr_free_pages());
+    }
+    return page;
+}
+
+//alloc_pages_bulk - get up to n single pages in one interrupt-off section,
+//                 - store them in store[] and return how many were got.
+//                 - it doesn't wait for reclaim, callers fall back to alloc_page() for the rest
+size_t
+alloc_pages_bulk(size_t n, struct Page **store) {
+    size_t nr = 0;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        if (pcp.enabled) {
+            while (nr < n && (store[nr] = page_cache_alloc()) != NULL) {
+                nr ++;
+            }
+        }
+        else {
+            while (nr < n && (store[nr] = pmm_manager->alloc_pages(1)) != NULL) {
+                nr ++;
+            }
+        }
+    }
+    local_intr_restore(intr_flag);
+    if (nr > 0 && swap_init_ok) {
+        swap_balance(nr_free_pages());
+    }
+    return nr;
+}
+
+//free_pages_bulk - free the n single pages in store[] in one interrupt-off section
+void
+free_pages_bulk(struct Page **store, size_t n) {
+    size_t i;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        for (i = 0; i < n; i ++) {
+            if (pcp.enabled) {
+                page_cache_free(store[i]);
+            }
+            else {
+                pmm_manager->free_pages(store[i], 1);
+            }
+        }
+    }
+    local_intr_restore(intr_flag);
+}
+
+//alloc_zeroed_page - get a page filled with zeros, from zero_pool if it has one,
+//                  - else allocate one and clear it here
+struct Page *
+alloc_zeroed_page(void) {
+    struct Page *page;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        page = zero_pool_alloc();
     }
     local_intr_restore(intr_flag);
+    if (page == NULL) {
+        if ((page = alloc_page()) != NULL) {
+            memset(page2kva(page), 0, PGSIZE);
+        }
+    }
+    else if (swap_init_ok) {
+        swap_balance(nr_free_pages());
+    }
+    return page;
+}
+
+//zero_pool_refill - clear one free page and put it in zero_pool, called from cpu_idle.
+//                 - it stops when the pool is full or free memory gets near the
+//                 - high watermark, and returns 0 if it did nothing.
+bool
+zero_pool_refill(void) {
+    struct Page *page;
+    if (nr_zero_pool >= ZERO_POOL_HIGH || nr_free_pages() <= high_free_pages + ZERO_POOL_HIGH) {
+        return 0;
+    }
+    if (alloc_pages_bulk(1, &page) == 0) {
+        return 0;
+    }
+    // interrupts stay on while clearing, the pool isn't touched yet
+    memset(page2kva(page), 0, PGSIZE);
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        list_add(&zero_pool, &(page->page_link));
+        nr_zero_pool ++;
+    }
+    local_intr_restore(intr_flag);
+    return 1;
 }
 
 //nr_free_pages - call pmm->nr_free_pages to get the size (nr*PAGESIZE) 
-//of current free memory
+//of current free memory, the pages held in the page cache and zero_pool are free too
 size_t
 nr_free_pages(void) {
     size_t ret;
     bool intr_flag;
     local_intr_save(intr_flag);
     {
-        ret = pmm_manager->nr_free_pages();
+        ret = pmm_manager->nr_free_pages() + pcp.nr_hot + pcp.nr_cold + nr_zero_pool;
     }
     local_intr_restore(intr_flag);
     return ret;
 }
 
+//memmap_init_section - init the struct Pages of the nth section in pages[],
+//                    - and give its free memory to pmm_manager
+static void
+memmap_init_section(size_t nth) {
+    struct e820map *memmap = (struct e820map *)(0x8000 + KERNBASE);
+    struct Page *base = pages + nth * PAGES_PER_SECTION;
+    uint64_t sbegin = (uint64_t)section_nr[nth] << SECTION_SHIFT, send = sbegin + SECTION_SIZE;
+    int i;
+    for (i = 0; i < PAGES_PER_SECTION; i ++) {
+        base[i].flags = 0;
+        SetPageReserved(base + i);
+        page_anon[nth * PAGES_PER_SECTION + i] = NULL;
+    }
+    for (i = 0; i < memmap->nr_map; i ++) {
+        uint64_t begin = memmap->map[i].addr, end = begin + memmap->map[i].size;
+        if (memmap->map[i].type == E820_ARM) {
+            if (begin < sbegin) {
+                begin = sbegin;
+            }
+            if (begin < memmap_freemem) {
+                begin = memmap_freemem;
+            }
+            if (end > send) {
+                end = send;
+            }
+            if (end > memmap_maxpa) {
+                end = memmap_maxpa;
+            }
+            if (begin < end) {
+                begin = ROUNDUP(begin, PGSIZE);
+                end = ROUNDDOWN(end, PGSIZE);
+                // in pages[] the next section with memory follows right after this one,
+                // keep the last page reserved so no free block runs over the hole
+                if (end == send && end < memmap_maxpa && section_index[end >> SECTION_SHIFT] == SECTION_NONE) {
+                    end -= PGSIZE;
+                }
+                if (begin < end) {
+                    init_memmap(pa2page(begin), (end - begin) / PGSIZE);
+                }
+            }
+        }
+    }
+}
+
+//memmap_init_next - init the next deferred section, return 0 if there is none
+static bool
+memmap_init_next(void) {
+    bool ret = 0, intr_flag;
+    local_intr_save(intr_flag);
+    {
+        if (memmap_next < nr_memmap / PAGES_PER_SECTION) {
+            memmap_init_section(memmap_next ++);
+            ret = 1;
+        }
+    }
+    local_intr_restore(intr_flag);
+    return ret;
+}
+
+//memmap_init_main - the kernel thread that inits the deferred sections, one section
+//                 - each time it gets the CPU, and yields after each section
+static int
+memmap_init_main(void *arg) {
+    while (memmap_init_next()) {
+        schedule();
+    }
+    cprintf("memmap: all %d sections initialized, %d free pages\n", nr_memmap / PAGES_PER_SECTION, nr_free_pages());
+    init_watermarks();
+    return 0;
+}
+
+//memmap_init_deferred - called by init_main once the boot checks are done
+void
+memmap_init_deferred(void) {
+    memmap_lazy = 1;
+    if (kernel_thread(memmap_init_main, NULL, 0) <= 0) {
+        panic("create memmap_init failed.\n");
+    }
+}
+
 /* pmm_init - initialize the physical memory management */
 static void
 page_init(void) {
@@ -224,36 +650,65 @@ page_init(void) {
     extern char end[];
 
     npage = maxpa / PGSIZE;
-    pages = (struct Page *)ROUNDUP((void *)end, PGSIZE);
 
-    for (i = 0; i < npage; i ++) {
-        SetPageReserved(pages + i);
+    // find the sections with memory, and give each of them its place in pages[]
+    size_t sec, nr_sections = 0;
+    for (sec = 0; sec < NR_SECTIONS; sec ++) {
+        section_index[sec] = SECTION_NONE;
     }
-
-    uintptr_t freemem = PADDR((uintptr_t)pages + sizeof(struct Page) * npage);
-
     for (i = 0; i < memmap->nr_map; i ++) {
         uint64_t begin = memmap->map[i].addr, end = begin + memmap->map[i].size;
-        if (memmap->map[i].type == E820_ARM) {
-            if (begin < freemem) {
-                begin = freemem;
-            }
-            if (end > KMEMSIZE) {
-                end = KMEMSIZE;
+        if (memmap->map[i].type == E820_ARM && begin < maxpa) {
+            if (end > maxpa) {
+                end = maxpa;
             }
-            if (begin < end) {
-                begin = ROUNDUP(begin, PGSIZE);
-                end = ROUNDDOWN(end, PGSIZE);
-                if (begin < end) {
-                    init_memmap(pa2page(begin), (end - begin) / PGSIZE);
-                }
+            for (sec = begin >> SECTION_SHIFT; sec <= (end - 1) >> SECTION_SHIFT; sec ++) {
+                section_index[sec] = 0;
             }
         }
     }
+    for (sec = 0; sec < NR_SECTIONS; sec ++) {
+        if (section_index[sec] != SECTION_NONE) {
+            section_index[sec] = nr_sections, section_nr[nr_sections] = sec;
+            nr_sections ++;
+        }
+    }
+    nr_memmap = nr_sections * PAGES_PER_SECTION;
+    pages = (struct Page *)ROUNDUP((void *)end, PGSIZE);
+
+    // a power of two size keeps every struct Page in one cache line
+    static_assert((sizeof(struct Page) & (sizeof(struct Page) - 1)) == 0);
+    cprintf("memmap: %d of %d sections, %d pages * %d bytes = %d KB\n", nr_sections, ROUNDUP(npage, PAGES_PER_SECTION) / PAGES_PER_SECTION,
+            nr_memmap, sizeof(struct Page), sizeof(struct Page) * nr_memmap / 1024);
+
+    page_anon = (struct anon_vma **)(pages + nr_memmap);
+    memmap_freemem = PADDR((uintptr_t)(page_anon + nr_memmap));
+    memmap_maxpa = maxpa;
+
+    // init the early sections now; of the deferred ones only the first and the
+    // last struct Page are set reserved, so no free block merges into them
+    uint64_t early_end = ROUNDUP(memmap_freemem, SECTION_SIZE) + MEMMAP_EARLY_SIZE;
+    for (memmap_next = 0; memmap_next < nr_sections; memmap_next ++) {
+        if (((uint64_t)section_nr[memmap_next] << SECTION_SHIFT) >= early_end) {
+            break;
+        }
+        memmap_init_section(memmap_next);
+    }
+    for (sec = memmap_next; sec < nr_sections; sec ++) {
+        struct Page *first = pages + sec * PAGES_PER_SECTION, *last = first + PAGES_PER_SECTION - 1;
+        first->flags = last->flags = 0;
+        SetPageReserved(first);
+        SetPageReserved(last);
+    }
+    cprintf("memmap: %d sections initialized, %d deferred\n", memmap_next, nr_sections - memmap_next);
 }
 
 static void
 enable_paging(void) {
+    // 4MB PDEs are only understood once CR4.PSE is set
+    if (pse_on) {
+        lcr4(rcr4() | CR4_PSE);
+    }
     lcr3(boot_cr3);
 
     // turn on paging
@@ -269,16 +724,23 @@ enable_paging(void) {
 //  size: memory size
 //  pa:   physical address of this memory
 //  perm: permission of this memory  
+//note: with PSE, every 4MB aligned chunk that has no page table yet is mapped by one PDE
 static void
 boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, uintptr_t pa, uint32_t perm) {
     assert(PGOFF(la) == PGOFF(pa));
     size_t n = ROUNDUP(size + PGOFF(la), PGSIZE) / PGSIZE;
     la = ROUNDDOWN(la, PGSIZE);
     pa = ROUNDDOWN(pa, PGSIZE);
-    for (; n > 0; n --, la += PGSIZE, pa += PGSIZE) {
+    while (n > 0) {
+        if (pse_on && n >= NPTEENTRY && (la | pa) % PTSIZE == 0 && !(pgdir[PDX(la)] & PTE_P)) {
+            pgdir[PDX(la)] = pa | PTE_PS | PTE_P | perm;
+            n -= NPTEENTRY, la += PTSIZE, pa += PTSIZE;
+            continue;
+        }
         pte_t *ptep = get_pte(pgdir, la, 1);
-        assert(ptep != NULL);
+        assert(ptep != NULL && !(*ptep & PTE_PS));
         *ptep = pa | PTE_P | perm;
+        n --, la += PGSIZE, pa += PGSIZE;
     }
 }
 
@@ -304,14 +766,25 @@ pmm_init(void) {
     //Then pmm can alloc/free the physical memory. 
     //Now the first_fit/best_fit/worst_fit/buddy_system pmm are available.
     init_pmm_manager();
+    page_cache_init();
+    zero_pool_init();
 
     // detect physical memory space, reserve already used memory,
     // then use pmm->init_memmap to create free page list
     page_init();
+    init_watermarks();
 
     //use pmm->check to verify the correctness of the alloc/free function in a pmm
     check_alloc_page();
 
+    //measure how long alloc/free take with this pmm, so the managers can be compared
+    check_alloc_latency();
+
+    //from now on single pages come from the order-0 page cache
+    pcp.enabled = 1;
+    check_page_cache();
+    check_zero_pool();
+
     // create boot_pgdir, an initial page directory(Page Directory Table, PDT)
     boot_pgdir = boot_alloc_page();
     memset(boot_pgdir, 0, PGSIZE);
@@ -328,6 +801,8 @@ pmm_init(void) {
     // map all physical memory to linear memory with base linear addr KERNBASE
     //linear_addr KERNBASE~KERNBASE+KMEMSIZE = phy_addr 0~KMEMSIZE
     //But shouldn't use this map until enable_paging() & gdt_init() finished.
+    //With PSE it takes 4MB pages and no page table pages at all.
+    pse_on = cpu_has_pse();
     boot_map_segment(boot_pgdir, KERNBASE, KMEMSIZE, 0, PTE_W);
 
     //temporary map: 
@@ -354,8 +829,129 @@ pmm_init(void) {
 
 }
 
+//pt_unshare - give pgdir its own copy of the page table behind *pdep, which fork
+//           - left shared (pde_shared). the pages mapped by both copies become copy
+//           - on write, and swap slots get one more holder. the last holder of the
+//           - page table just takes it back writable. the caller flushes the TLB.
+static int
+pt_unshare(pde_t *pdep) {
+    struct Page *pt = pde2page(*pdep);
+    if (page_ref(pt) > 1) {
+        struct Page *npt;
+        if ((npt = alloc_page()) == NULL) {
+            return -E_NO_MEM;
+        }
+        pte_t *ptep = page2kva(pt), *nptep = page2kva(npt);
+        int i;
+        for (i = 0; i < NPTEENTRY; i ++) {
+            if (ptep[i] & PTE_P) {
+                // the other holders can't write through their PDE anyway
+                ptep[i] &= ~PTE_W;
+                page_ref_inc(pte2page(ptep[i]));
+            }
+            else if (ptep[i] != 0) {
+                swap_duplicate(ptep[i]);
+            }
+            nptep[i] = ptep[i];
+        }
+        set_page_ref(npt, 1);
+        page_ref_dec(pt);
+        *pdep = page2pa(npt) | PTE_P | PTE_U;
+    }
+    *pdep |= PTE_W;
+    return 0;
+}
+
+//pt_drop - forget a page table of pgdir that other processes still share, its
+//        - PTEs are left to them. a queued page moves to the queue of one of
+//        - them (rmap_requeue), so a queued page is always mapped by its mm.
+static void
+pt_drop(pde_t *pgdir, pde_t *pdep) {
+    struct Page *pt = pde2page(*pdep);
+    pte_t *ptep = page2kva(pt);
+    int i;
+    for (i = 0; i < NPTEENTRY; i ++) {
+        if (ptep[i] & PTE_P) {
+            rmap_requeue(pte2page(ptep[i]), pgdir);
+        }
+    }
+    page_ref_dec(pt);
+    *pdep = 0;
+}
+
+/* *
+ * 4MB user pages
+ *
+ * A write fault (do_pgfault) or mm_populate maps an aligned 4MB of an
+ * anonymous vma with one PSE page (a user PDE with PTE_PS, see pde_huge)
+ * when an aligned block of NPTEENTRY pages is free. Every page of the block keeps its own ref, as if it were
+ * mapped by a PTE, so a 4MB page can always be split into a page table of
+ * its pages (huge_split) and from then on is just 1024 pages: get_pte with
+ * create, a cut by unshare_range, copy on write and swap_out all split it.
+ * Only the head page sits in the swap queue while the page is whole.
+ * */
+
+//huge_split - replace the 4MB page pgdir maps at la by a page table of its pages,
+//           - with the same permissions. nothing happens if la isn't in a 4MB page.
+int
+huge_split(pde_t *pgdir, uintptr_t la) {
+    pde_t *pdep = &pgdir[PDX(la)];
+    if (!pde_huge(*pdep)) {
+        return 0;
+    }
+    struct Page *pt;
+    if ((pt = alloc_page()) == NULL) {
+        return -E_NO_MEM;
+    }
+    // alloc_page may reclaim, and swap_out splits or unmaps the 4MB page itself
+    if (!pde_huge(*pdep)) {
+        free_page(pt);
+        return 0;
+    }
+    set_page_ref(pt, 1);
+    pte_t *ptep = page2kva(pt);
+    uintptr_t pa = PDE_PS_ADDR(*pdep);
+    uint32_t perm = (*pdep & PTE_USER);
+    int i;
+    for (i = 0; i < NPTEENTRY; i ++) {
+        ptep[i] = (pa + i * PGSIZE) | perm;
+    }
+    swap_split_page(pa2page(pa), NPTEENTRY);
+    *pdep = page2pa(pt) | PTE_P | PTE_U | PTE_W;
+    tlb_invalidate(pgdir, la);
+    return 0;
+}
+
+//huge_unmap - remove the 4MB page *pdep maps at la, its pages are freed as their
+//           - last mapping goes, in runs of contiguous pages.
+static void
+huge_unmap(struct tlb_gather *tlb, pde_t *pdep, uintptr_t la) {
+    struct Page *page = pa2page(PDE_PS_ADDR(*pdep));
+    size_t i, nr = 0;
+    for (i = 0; i < NPTEENTRY; i ++) {
+        if (page_ref_dec(page + i) == 0) {
+            swap_remove_page(page + i);
+            nr ++;
+            continue ;
+        }
+        rmap_requeue(page + i, tlb->pgdir);
+        if (nr != 0) {
+            free_pages(page + i - nr, nr), nr = 0;
+        }
+    }
+    if (nr != 0) {
+        free_pages(page + NPTEENTRY - nr, nr);
+    }
+    *pdep = 0;
+    // one invlpg anywhere in a 4MB page drops its TLB entry
+    tlb_gather_add(tlb, la);
+}
+
 //get_pte - get pte and return the kernel virtual address of this pte for la
 //        - if the PT contians this pte didn't exist, alloc a page for PT
+//        - if la is mapped by a 4MB page (PTE_PS), there is no PT, the PDE is returned.
+//        - with create, a 4MB user page is split first (huge_split)
+//        - if create and the PT is shared since fork, pgdir gets its own copy first
 // parameter:
 //  pgdir:  the kernel virtual base address of PDT
 //  la:     the linear address need to map
@@ -398,21 +994,31 @@ get_pte(pde_t *pgdir, uintptr_t la, bool create) {
 #endif
     pde_t *pdep=&pgdir[PDX(la)];// (1) find page directory entry
     //使用PDX(la)，获取虚拟地址la的页目录索引（即一级页表位置）,再用pgdir来定位该pte的内核虚拟地址
+    if (create && pde_huge(*pdep) && huge_split(pgdir, la) != 0) {
+        return NULL;
+    }
+    if (*pdep & PTE_PS) {
+        return pdep;
+    }
+    if (create && pde_shared(*pdep)) {
+        if (pt_unshare(pdep) != 0) {
+            return NULL;
+        }
+        tlb_flush(pgdir);
+    }
     if (!(*pdep&PTE_P)){// (2) check if entry is not present 
         //若该二级页表项不存在
         struct Page *page;
         //则需要根据create位的值来判断是否创建这个二级页表
         //create为0，不创建；反之则创建
-        if(!create||(page=alloc_page())==NULL){// (3) check if creating is needed, then alloc page for page table
+        if(!create||(page=alloc_zeroed_page())==NULL){// (3) check if creating is needed, then alloc page for page table
             return NULL;//若无需创建或分配页失败则返回NULL
         }
         set_page_ref(page,1);// (4) set page reference
         //查找该页表时，引用次数+1
         uintptr_t pa=page2pa(page);// (5) get linear address of page
         //获取该页的物理地址
-        memset(KADDR(pa),0,PGSIZE);// (6) clear page content using memset
-        //物理地址转虚拟地址
-        //由于该页虚拟地址未被映射，所以需要初始化
+        // (6) the page is already cleared by alloc_zeroed_page
         *pdep = pa|PTE_P|PTE_U|PTE_W;// (7) set page directory entry's permission
         //设置控制位（存在，可读，可写）
     }
@@ -428,7 +1034,7 @@ get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store) {
         *ptep_store = ptep;
     }
     if (ptep != NULL && *ptep & PTE_P) {
-        return pa2page(*ptep);
+        return pa2page(pte_pa(*ptep, la));
     }
     return NULL;
 }
@@ -436,8 +1042,9 @@ get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store) {
 //page_remove_pte - free an Page sturct which is related linear address la
 //                - and clean(invalidate) pte which is related linear address la
 //note: PT is changed, so the TLB need to be invalidate 
+//note: with a tlb_gather the invalidation is only recorded, the caller flushes it with tlb_finish
 static inline void
-page_remove_pte(pde_t *pgdir, uintptr_t la, pte_t *ptep) {
+page_remove_pte(pde_t *pgdir, uintptr_t la, pte_t *ptep, struct tlb_gather *tlb) {
     /* LAB2 EXERCISE 3: YOUR CODE
      *
      * Please check if ptep is valid, and tlb must be manually updated if mapping is updated
@@ -467,112 +1074,255 @@ page_remove_pte(pde_t *pgdir, uintptr_t la, pte_t *ptep) {
         //PTE_P代表页存在，判断页表中该表项是否存在
         struct Page *page=pte2page(*ptep);//(2) find corresponding page to pte
         //获取该页
-        if(page_ref_dec(page)==0){//(3) decrease page reference
+        //a reserved frame mapped to user (e.g. program text, see vma_alloc_page) is never freed
+        if(page_ref_dec(page)==0&&!PageReserved(page)){//(3) decrease page reference
         //判断是否只被引用了一次，若是1次的话，调用page_ref_dec减1，值就为0
+            swap_remove_page(page);
             free_page(page);//(4) and free this page when page reference reachs 0
             //若只被引用一次，则释放此页
             //因为为0的话，相当于不存在任何虚拟页指向该物理页
         }
+        else {
+            //a shared (copy on write) page may sit in the swap queue of the mm
+            //that loses it here, it goes on to the queue of one that keeps it
+            rmap_requeue(page, pgdir);
+        }
         *ptep = 0;//(5) clear second page table entry
     	//若被多次引用，则无需释放此页，只需释放对应的二级页表项
     	//即设置二级页表项为0，表示该映射关系无效
-        tlb_invalidate(pgdir, la);//(6) flush tlb
+        if (tlb != NULL) {
+            tlb_gather_add(tlb, la);
+        }
+        else {
+            tlb_invalidate(pgdir, la);//(6) flush tlb
+        }
         //刷新TLB，保证TLB中的缓存不会有错误的映射关系
     }
+    else if (*ptep != 0) {
+        //a swap entry, drop this PTE's hold on the swap slot
+        swap_free(*ptep);
+        *ptep = 0;
+    }
 }
 
-void
-unmap_range(pde_t *pgdir, uintptr_t start, uintptr_t end) {
+// pt_range_end - the end of the part of [la, end) that the page table of la maps
+static inline uintptr_t
+pt_range_end(uintptr_t la, uintptr_t end) {
+    uintptr_t pt_end = ROUNDDOWN(la + PTSIZE, PTSIZE);
+    return (pt_end == 0 || pt_end > end) ? end : pt_end;
+}
+
+// pt_unmap - remove the PTEs of [start, end), which are all in the page table ptep points into
+static void
+pt_unmap(struct tlb_gather *tlb, pte_t *ptep, uintptr_t start, uintptr_t end) {
+    for (; start < end; start += PGSIZE, ptep ++) {
+        if (*ptep != 0) {
+            page_remove_pte(tlb->pgdir, start, ptep, tlb);
+        }
+    }
+}
+
+//unmap_range_gather - unmap [start, end) of tlb->pgdir, the TLB is flushed later by tlb_finish,
+//                   - so that a caller unmapping several ranges flushes just once.
+//                   - a missing page table is skipped in one step, a present one is walked
+//                   - in place, with no get_pte for each page.
+//                   - a 4MB page inside the range goes at once, one that the range only
+//                   - cuts is split first (huge_split), which may fail with -E_NO_MEM.
+int
+unmap_range_gather(struct tlb_gather *tlb, uintptr_t start, uintptr_t end) {
     assert(start % PGSIZE == 0 && end % PGSIZE == 0);
     assert(USER_ACCESS(start, end));
-
-    do {
-        pte_t *ptep = get_pte(pgdir, start, 0);
-        if (ptep == NULL) {
-            start = ROUNDDOWN(start + PTSIZE, PTSIZE);
-            continue ;
+    pde_t *pgdir = tlb->pgdir;
+    int ret = 0;
+
+    while (start < end) {
+        uintptr_t pt_end = pt_range_end(start, end);
+        pde_t *pdep = &pgdir[PDX(start)];
+        if (pde_huge(*pdep)) {
+            if (start % PTSIZE == 0 && pt_end - start == PTSIZE) {
+                huge_unmap(tlb, pdep, start);
+                start = pt_end;
+                continue ;
+            }
+            if ((ret = huge_split(pgdir, start)) != 0) {
+                break;
+            }
         }
-        if (*ptep != 0) {
-            page_remove_pte(pgdir, start, ptep);
+        if (*pdep & PTE_P) {
+            pt_unmap(tlb, (pte_t *)KADDR(PDE_ADDR(*pdep)) + PTX(start), start, pt_end);
         }
-        start += PGSIZE;
-    } while (start != 0 && start < end);
+        start = pt_end;
+    }
+    return ret;
+}
+
+int
+unmap_range(pde_t *pgdir, uintptr_t start, uintptr_t end) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+    int ret = unmap_range_gather(&tlb, start, end);
+    tlb_finish(&tlb);
+    return ret;
 }
 
+//exit_range - unmap [start, end) and free the page tables it touches, in one pass over
+//           - the page tables. the caller gives up all of their 4MB, e.g. exit_mmap.
+//           - a page table still shared with other processes is only dropped.
 void
 exit_range(pde_t *pgdir, uintptr_t start, uintptr_t end) {
     assert(start % PGSIZE == 0 && end % PGSIZE == 0);
     assert(USER_ACCESS(start, end));
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+
+    while (start < end) {
+        uintptr_t pt_end = pt_range_end(start, end);
+        pde_t *pdep = &pgdir[PDX(start)];
+        if (pde_shared(*pdep) && page_ref(pde2page(*pdep)) > 1) {
+            pt_drop(pgdir, pdep);
+        }
+        else if (pde_huge(*pdep)) {
+            huge_unmap(&tlb, pdep, ROUNDDOWN(start, PTSIZE));
+        }
+        else if (*pdep & PTE_P) {
+            uintptr_t pt_start = ROUNDDOWN(start, PTSIZE);
+            pt_unmap(&tlb, (pte_t *)KADDR(PDE_ADDR(*pdep)), pt_start, pt_start + PTSIZE);
+            free_page(pde2page(*pdep));
+            *pdep = 0;
+        }
+        start = pt_end;
+    }
+    tlb_finish(&tlb);
+}
+
+/* share_range - let process B share the page tables of process A for (start, end)
+ * @to:    the addr of process B's Page Directory
+ * @from:  the addr of process A's Page Directory
+ *
+ * Only the PDEs are copied, so fork costs one step per 4MB instead of one per page.
+ * Both PDEs lose PTE_W, the first write fault or change to the PTEs behind such a
+ * PDE gives that process a private copy of the page table (pt_unshare), and the
+ * pages themselves are then copied on write by do_pgfault. A page table already
+ * shared by an earlier vma in the same 4MB is skipped. A 4MB page is shared the
+ * same way, write protected, with one more ref on each of its pages.
+ *
+ * CALL GRAPH: copy_mm-->dup_mmap-->share_range
+ */
+void
+share_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end) {
+    assert(start % PGSIZE == 0 && end % PGSIZE == 0);
+    assert(USER_ACCESS(start, end));
+    bool wrprotect = 0;
 
     start = ROUNDDOWN(start, PTSIZE);
     do {
-        int pde_idx = PDX(start);
-        if (pgdir[pde_idx] & PTE_P) {
-            free_page(pde2page(pgdir[pde_idx]));
-            pgdir[pde_idx] = 0;
+        pde_t *pdep = &from[PDX(start)];
+        if ((*pdep & PTE_P) && to[PDX(start)] == 0) {
+            if (*pdep & PTE_W) {
+                *pdep &= ~PTE_W;
+                wrprotect = 1;
+            }
+            if (pde_huge(*pdep)) {
+                struct Page *page = pa2page(PDE_PS_ADDR(*pdep));
+                int i;
+                for (i = 0; i < NPTEENTRY; i ++) {
+                    page_ref_inc(page + i);
+                }
+            }
+            else {
+                page_ref_inc(pde2page(*pdep));
+            }
+            to[PDX(start)] = *pdep;
         }
         start += PTSIZE;
     } while (start != 0 && start < end);
+    if (wrprotect) {
+        tlb_flush(from);
+    }
 }
-/* copy_range - copy content of memory (start, end) of one process A to another process B
- * @to:    the addr of process B's Page Directory
- * @from:  the addr of process A's Page Directory
- * @share: flags to indicate to dup OR share. We just use dup method, so it didn't be used.
- *
- * CALL GRAPH: copy_mm-->dup_mmap-->copy_range
- */
+
+//unshare_range - called before the PTEs of [start, end) are changed, e.g. unmapped.
+//              - a shared page table whose user part is inside the range is dropped,
+//              - pgdir loses all of it anyway; one that the range only cuts gets copied.
+//              - a 4MB page that the range only cuts is split.
 int
-copy_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end, bool share) {
+unshare_range(pde_t *pgdir, uintptr_t start, uintptr_t end) {
     assert(start % PGSIZE == 0 && end % PGSIZE == 0);
     assert(USER_ACCESS(start, end));
-    // copy content by page unit.
+    int ret = 0;
+    bool flush = 0;
+
+    uintptr_t la = ROUNDDOWN(start, PTSIZE);
     do {
-        //call get_pte to find process A's pte according to the addr start
-        pte_t *ptep = get_pte(from, start, 0), *nptep;
-        if (ptep == NULL) {
-            start = ROUNDDOWN(start + PTSIZE, PTSIZE);
-            continue ;
+        pde_t *pdep = &pgdir[PDX(la)];
+        if (pde_shared(*pdep)) {
+            uintptr_t pt_start = (la < USERBASE) ? USERBASE : la;
+            uintptr_t pt_end = (la + PTSIZE > USERTOP) ? USERTOP : la + PTSIZE;
+            if (start <= pt_start && pt_end <= end && page_ref(pde2page(*pdep)) > 1) {
+                pt_drop(pgdir, pdep);
+            }
+            else if ((ret = pt_unshare(pdep)) != 0) {
+                break;
+            }
+            flush = 1;
         }
-        //call get_pte to find process B's pte according to the addr start. If pte is NULL, just alloc a PT
-        if (*ptep & PTE_P) {
-            if ((nptep = get_pte(to, start, 1)) == NULL) {
-                return -E_NO_MEM;
+        else if (pde_huge(*pdep) && !(start <= la && la + PTSIZE <= end)) {
+            if ((ret = huge_split(pgdir, la)) != 0) {
+                break;
             }
-        uint32_t perm = (*ptep & PTE_USER);
-        //get page from ptep
-        struct Page *page = pte2page(*ptep);
-        // alloc a page for process B
-        struct Page *npage=alloc_page();
-        assert(page!=NULL);
-        assert(npage!=NULL);
-        int ret=0;
-        /* LAB5:EXERCISE2 YOUR CODE
-         * replicate content of page to npage, build the map of phy addr of nage with the linear addr start
-         *
-         * Some Useful MACROs and DEFINEs, you can use them in below implementation.
-         * MACROs or Functions:
-         *    page2kva(struct Page *page): return the kernel vritual addr of memory which page managed (SEE pmm.h)
-         *    page_insert: build the map of phy addr of an Page with the linear addr la
-         *    memcpy: typical memory copy function
-         *
-         * (1) find src_kvaddr: the kernel virtual address of page
-         * (2) find dst_kvaddr: the kernel virtual address of npage
-         * (3) memory copy from src_kvaddr to dst_kvaddr, size is PGSIZE
-         * (4) build the map of phy addr of  nage with the linear addr start
-         */
-        void *src_kvaddr=page2kva(page); //获得父进程（源页面）的内核虚拟页地址
-        //find src_kvaddr: the kernel virtual address of page
-        void *dst_kvaddr=page2kva(npage); //获得子进程（目标页面）的内核虚拟页地址
-        //find dst_kvaddr: the kernel virtual address of npage
-        memcpy(dst_kvaddr,src_kvaddr,PGSIZE);//将父进程数据复制到子进程中，大小为PGSIZE
-        //memory copy from src_kvaddr to dst_kvaddr, size is PGSIZE
-        ret=page_insert(to,npage,start,perm);//建立子进程的物理页与虚拟页的映射关系
-        //build the map of phy addr of  nage with the linear addr start
-        assert(ret == 0);
-        }
-        start += PGSIZE;
-    } while (start != 0 && start < end);
-    return 0;
+        }
+        la += PTSIZE;
+    } while (la != 0 && la < end);
+    if (flush) {
+        tlb_flush(pgdir);
+    }
+    return ret;
+}
+
+//protect_range - write protect the pages mapped in [start, end), e.g. for mm_protect.
+//              - a page table shared since fork gets copied first, a 4MB page that the
+//              - range only cuts is split. the TLB is flushed once at the end.
+int
+protect_range(pde_t *pgdir, uintptr_t start, uintptr_t end) {
+    assert(start % PGSIZE == 0 && end % PGSIZE == 0);
+    assert(USER_ACCESS(start, end));
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+    int ret = 0;
+    bool flush = 0;
+
+    while (start < end) {
+        uintptr_t pt_end = pt_range_end(start, end);
+        pde_t *pdep = &pgdir[PDX(start)];
+        if (pde_huge(*pdep) && start % PTSIZE == 0 && pt_end - start == PTSIZE) {
+            *pdep &= ~PTE_W;
+            tlb_gather_add(&tlb, start);
+        }
+        else if (*pdep & PTE_P) {
+            if ((ret = huge_split(pgdir, start)) != 0) {
+                break;
+            }
+            if (pde_shared(*pdep)) {
+                if ((ret = pt_unshare(pdep)) != 0) {
+                    break;
+                }
+                flush = 1;
+            }
+            pte_t *ptep = (pte_t *)KADDR(PDE_ADDR(*pdep)) + PTX(start);
+            for (; start < pt_end; start += PGSIZE, ptep ++) {
+                if ((*ptep & (PTE_P | PTE_W)) == (PTE_P | PTE_W)) {
+                    *ptep &= ~PTE_W;
+                    tlb_gather_add(&tlb, start);
+                }
+            }
+        }
+        start = pt_end;
+    }
+    if (flush) {
+        tlb_flush(pgdir);
+    }
+    tlb_finish(&tlb);
+    return ret;
 }
 
 //page_remove - free an Page which is related linear address la and has an validated pte
@@ -580,7 +1330,7 @@ void
 page_remove(pde_t *pgdir, uintptr_t la) {
     pte_t *ptep = get_pte(pgdir, la, 0);
     if (ptep != NULL) {
-        page_remove_pte(pgdir, la, ptep);
+        page_remove_pte(pgdir, la, ptep, NULL);
     }
 }
 
@@ -605,7 +1355,7 @@ page_insert(pde_t *pgdir, struct Page *page, uintptr_t la, uint32_t perm) {
             page_ref_dec(page);
         }
         else {
-            page_remove_pte(pgdir, la, ptep);
+            page_remove_pte(pgdir, la, ptep, NULL);
         }
     }
     *ptep = page2pa(page) | PTE_P | perm;
@@ -622,43 +1372,193 @@ tlb_invalidate(pde_t *pgdir, uintptr_t la) {
     }
 }
 
+// flush the whole TLB, but only if pgdir is the one in use by the processor.
+void
+tlb_flush(pde_t *pgdir) {
+    if (rcr3() == PADDR(pgdir)) {
+        lcr3(rcr3());
+    }
+}
+
+// tlb_gather_init - start collecting the TLB invalidations for PTE changes in pgdir.
+//                 - if pgdir isn't in use by the processor, there is nothing to collect.
+void
+tlb_gather_init(struct tlb_gather *tlb, pde_t *pgdir) {
+    tlb->pgdir = pgdir;
+    tlb->active = (rcr3() == PADDR(pgdir));
+    tlb->start = ~(uintptr_t)0, tlb->end = 0;
+}
+
+// tlb_finish - flush what tlb collected: invlpg page by page if the changed range is
+//            - at most TLB_FLUSH_PAGES pages, a CR3 reload if it is bigger.
+//            - tlb is empty again afterwards.
+void
+tlb_finish(struct tlb_gather *tlb) {
+    if (tlb->active && tlb->start < tlb->end) {
+        if ((tlb->end - tlb->start) / PGSIZE > TLB_FLUSH_PAGES) {
+            lcr3(rcr3());
+        }
+        else {
+            uintptr_t la;
+            for (la = tlb->start; la < tlb->end; la += PGSIZE) {
+                invlpg((void *)la);
+            }
+        }
+    }
+    tlb->start = ~(uintptr_t)0, tlb->end = 0;
+}
+
 // pgdir_alloc_page - call alloc_page & page_insert functions to 
 //                  - allocate a page size memory & setup an addr map
-//                  - pa<->la with linear address la and the PDT pgdir
+//                  - pa<->la with linear address la and the PDT pgdir.
+//                  - the page is zeroed, it comes from alloc_zeroed_page.
+//                  - the caller knows the mm, it makes the page swappable.
 struct Page *
 pgdir_alloc_page(pde_t *pgdir, uintptr_t la, uint32_t perm) {
-    struct Page *page = alloc_page();
+    struct Page *page = alloc_zeroed_page();
     if (page != NULL) {
         if (page_insert(pgdir, page, la, perm) != 0) {
             free_page(page);
             return NULL;
         }
-        if (swap_init_ok){
-            if(check_mm_struct!=NULL) {
-                swap_map_swappable(check_mm_struct, la, page, 0);
-                page->pra_vaddr=la;
-                assert(page_ref(page) == 1);
-                //cprintf("get No. %d  page: pra_vaddr %x, pra_link.prev %x, pra_link_next %x in pgdir_alloc_page\n", (page-pages), page->pra_vaddr,page->pra_page_link.prev, page->pra_page_link.next);
-            } 
-            else  {  //now current is existed, should fix it in the future
-                //swap_map_swappable(current->mm, la, page, 0);
-                //page->pra_vaddr=la;
-                //assert(page_ref(page) == 1);
-                //panic("pgdir_alloc_page: no pages. now current is existed, should fix it in the future\n");
-            }
-        }
-
     }
 
     return page;
 }
 
+// pgdir_alloc_pages_bulk - map n fresh pages at la, la + PGSIZE, ... in pgdir.
+//                        - pages are allocated PCP_BATCH at a time with alloc_pages_bulk.
+//                        - if store isn't NULL, the n pages are saved in store[].
+//                        - on failure the pages already mapped stay mapped, the caller
+//                        - tears them down with the rest of the address space.
+int
+pgdir_alloc_pages_bulk(pde_t *pgdir, uintptr_t la, size_t n, uint32_t perm, struct Page **store) {
+    struct Page *batch[PCP_BATCH];
+    while (n > 0) {
+        size_t i, got, nr = (n < PCP_BATCH) ? n : PCP_BATCH;
+        for (got = alloc_pages_bulk(nr, batch); got < nr; got ++) {
+            if ((batch[got] = alloc_page()) == NULL) {
+                free_pages_bulk(batch, got);
+                return -E_NO_MEM;
+            }
+        }
+        for (i = 0; i < nr; i ++, la += PGSIZE) {
+            if (page_insert(pgdir, batch[i], la, perm) != 0) {
+                free_pages_bulk(batch + i, nr - i);
+                return -E_NO_MEM;
+            }
+            if (store != NULL) {
+                *store ++ = batch[i];
+            }
+        }
+        n -= nr;
+    }
+    return 0;
+}
+
 static void
 check_alloc_page(void) {
     pmm_manager->check();
     cprintf("check_alloc_page() succeeded!\n");
 }
 
+static inline uint64_t
+read_tsc(void) {
+    uint64_t tsc;
+    asm volatile ("rdtsc" : "=A" (tsc));
+    return tsc;
+}
+
+#define LATENCY_ROUNDS              256
+
+//check_alloc_latency - print the average cycles of alloc_pages/free_pages for
+//                    - single pages and kernel stacks, one line per pmm_manager
+static void
+check_alloc_latency(void) {
+    static struct Page *store[LATENCY_ROUNDS];
+    size_t sizes[] = {1, KSTACKPAGE, 5};
+    int i, j;
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j ++) {
+        uint64_t start = read_tsc();
+        for (i = 0; i < LATENCY_ROUNDS; i ++) {
+            assert((store[i] = alloc_pages(sizes[j])) != NULL);
+        }
+        uint64_t middle = read_tsc();
+        // free every other block first, so the second half is freed into holes
+        for (i = 0; i < LATENCY_ROUNDS; i += 2) {
+            free_pages(store[i], sizes[j]);
+        }
+        for (i = 1; i < LATENCY_ROUNDS; i += 2) {
+            free_pages(store[i], sizes[j]);
+        }
+        uint64_t end = read_tsc();
+        cprintf("alloc latency: %s, %d pages, alloc %d cycles, free %d cycles\n",
+                pmm_manager->name, sizes[j], (uint32_t)((middle - start) / LATENCY_ROUNDS),
+                (uint32_t)((end - middle) / LATENCY_ROUNDS));
+    }
+}
+
+static void
+check_page_cache(void) {
+    size_t nr_free_store = nr_free_pages();
+    struct Page *p0, *p1, *p2;
+    assert((p0 = alloc_page()) != NULL);
+    assert((p1 = alloc_page()) != NULL);
+    assert(nr_free_pages() == nr_free_store - 2);
+
+    // hot_list is LIFO: the last page freed is the first one handed out
+    free_page(p0);
+    free_page(p1);
+    assert(pcp.nr_hot >= 2 && nr_free_pages() == nr_free_store);
+    assert((p2 = alloc_page()) == p1);
+    assert((p2 = alloc_page()) == p0);
+
+    // overflowing the cache hands a batch back to pmm_manager
+    static struct Page *store[PCP_HIGH + 1];
+    int i;
+    for (i = 0; i <= PCP_HIGH; i ++) {
+        assert((store[i] = alloc_page()) != NULL);
+    }
+    for (i = 0; i <= PCP_HIGH; i ++) {
+        free_page(store[i]);
+    }
+    assert(pcp.nr_hot + pcp.nr_cold <= PCP_HIGH);
+
+    free_page(p0);
+    free_page(p1);
+    assert(nr_free_pages() == nr_free_store);
+
+    cprintf("check_page_cache() succeeded!\n");
+}
+
+static void
+check_zero_pool(void) {
+    size_t nr_free_store = nr_free_pages();
+    struct Page *p0, *p1;
+    assert(nr_zero_pool == 0);
+
+    // a page refilled into the pool is cleared and still counts as free
+    assert((p0 = alloc_page()) != NULL);
+    memset(page2kva(p0), 0xff, PGSIZE);
+    free_page(p0);
+    assert(zero_pool_refill());
+    assert(nr_zero_pool == 1 && nr_free_pages() == nr_free_store);
+    assert((p1 = alloc_zeroed_page()) != NULL && nr_zero_pool == 0);
+    unsigned char *kva = page2kva(p1);
+    int i;
+    for (i = 0; i < PGSIZE; i ++) {
+        assert(kva[i] == 0);
+    }
+    free_page(p1);
+
+    // multi-page allocations can still get the pool pages back
+    assert(zero_pool_refill() && zero_pool_refill());
+    zero_pool_release();
+    assert(nr_zero_pool == 0 && nr_free_pages() == nr_free_store);
+
+    cprintf("check_zero_pool() succeeded!\n");
+}
+
 static void
 check_pgdir(void) {
     assert(npage <= KMEMSIZE / PGSIZE);
@@ -713,7 +1613,16 @@ check_boot_pgdir(void) {
     int i;
     for (i = 0; i < npage; i += PGSIZE) {
         assert((ptep = get_pte(boot_pgdir, (uintptr_t)KADDR(i), 0)) != NULL);
-        assert(PTE_ADDR(*ptep) == i);
+        assert(pte_pa(*ptep, (uintptr_t)KADDR(i)) == i);
+    }
+
+    // with PSE the whole KERNBASE map is made of 4MB pages
+    if (pse_on) {
+        for (i = 0; i < KMEMSIZE; i += PTSIZE) {
+            assert(boot_pgdir[PDX(KERNBASE + i)] & PTE_PS);
+            assert(PDE_PS_ADDR(boot_pgdir[PDX(KERNBASE + i)]) == i);
+        }
+        assert(get_pte(boot_pgdir, KERNBASE + PTSIZE + PGSIZE, 1) == &boot_pgdir[PDX(KERNBASE + PTSIZE)]);
     }
 
     assert(PDE_ADDR(boot_pgdir[PDX(VPT)]) == PADDR(boot_pgdir));
@@ -755,6 +1664,7 @@ perm2str(int perm) {
 //get_pgtable_items - In [left, right] range of PDT or PT, find a continuous linear addr space
 //                  - (left_store*X_SIZE~right_store*X_SIZE) for PDT or PT
 //                  - X_SIZE=PTSIZE=4M, if PDT; X_SIZE=PGSIZE=4K, if PT
+//                  - 4MB PDEs (PTE_PS) never share a range with PDEs of page tables
 // paramemters:
 //  left:        no use ???
 //  right:       the high side of table's range
@@ -775,8 +1685,8 @@ get_pgtable_items(size_t left, size_t right, size_t start, uintptr_t *table, siz
         if (left_store != NULL) {
             *left_store = start;
         }
-        int perm = (table[start ++] & PTE_USER);
-        while (start < right && (table[start] & PTE_USER) == perm) {
+        int perm = (table[start ++] & (PTE_USER | PTE_PS));
+        while (start < right && (table[start] & (PTE_USER | PTE_PS)) == perm) {
             start ++;
         }
         if (right_store != NULL) {
@@ -793,8 +1703,13 @@ print_pgdir(void) {
     cprintf("-------------------- BEGIN --------------------\n");
     size_t left, right = 0, perm;
     while ((perm = get_pgtable_items(0, NPDEENTRY, right, vpd, &left, &right)) != 0) {
-        cprintf("PDE(%03x) %08x-%08x %08x %s\n", right - left,
-                left * PTSIZE, right * PTSIZE, (right - left) * PTSIZE, perm2str(perm));
+        cprintf("PDE(%03x) %08x-%08x %08x %s%s\n", right - left,
+                left * PTSIZE, right * PTSIZE, (right - left) * PTSIZE, perm2str(perm),
+                (perm & PTE_PS) ? " 4M" : "");
+        // a 4MB page has no page table, vpt would show the page itself
+        if (perm & PTE_PS) {
+            continue;
+        }
         size_t l, r = left * NPTEENTRY;
         while ((perm = get_pgtable_items(left * NPTEENTRY, right * NPTEENTRY, r, vpt, &l, &r)) != 0) {
             cprintf("  |-- PTE(%05x) %08x-%08x %08x %s\n", r - l,
@@ -22,19 +22,41 @@ struct pmm_manager {
     void (*check)(void);                              // check the correctness of XXX_pmm_manager 
 };
 
+// tlb_gather collects the TLB invalidations of a batch of PTE changes in one pgdir
+// (e.g. unmapping a range), so that tlb_finish flushes them at once. Nothing is
+// collected while pgdir isn't the one in use, like in exit_mmap after do_exit has
+// switched to boot_cr3.
+struct tlb_gather {
+    pde_t *pgdir;       // the PDT whose PTEs are changed
+    bool active;        // pgdir is in CR3, so its TLB entries must go
+    uintptr_t start;    // the changed pages are in [start, end)
+    uintptr_t end;
+};
+
+#define TLB_FLUSH_PAGES         32 // tlb_finish reloads CR3 rather than invlpg more pages than this
+
 extern const struct pmm_manager *pmm_manager;
+extern size_t min_free_pages, low_free_pages, high_free_pages;
 extern pde_t *boot_pgdir;
 extern uintptr_t boot_cr3;
 
 void pmm_init(void);
+void memmap_init_deferred(void);
 
 struct Page *alloc_pages(size_t n);
+struct Page *alloc_pages_nowait(size_t n);
 void free_pages(struct Page *base, size_t n);
 size_t nr_free_pages(void);
 
 #define alloc_page() alloc_pages(1)
 #define free_page(page) free_pages(page, 1)
 
+size_t alloc_pages_bulk(size_t n, struct Page **store);
+void free_pages_bulk(struct Page **store, size_t n);
+
+struct Page *alloc_zeroed_page(void);
+bool zero_pool_refill(void);
+
 pte_t *get_pte(pde_t *pgdir, uintptr_t la, bool create);
 struct Page *get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store);
 void page_remove(pde_t *pgdir, uintptr_t la);
@@ -42,10 +64,19 @@ int page_insert(pde_t *pgdir, struct Page *page, uintptr_t la, uint32_t perm);
 
 void load_esp0(uintptr_t esp0);
 void tlb_invalidate(pde_t *pgdir, uintptr_t la);
+void tlb_flush(pde_t *pgdir);
+void tlb_gather_init(struct tlb_gather *tlb, pde_t *pgdir);
+void tlb_finish(struct tlb_gather *tlb);
 struct Page *pgdir_alloc_page(pde_t *pgdir, uintptr_t la, uint32_t perm);
-void unmap_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
+int pgdir_alloc_pages_bulk(pde_t *pgdir, uintptr_t la, size_t n, uint32_t perm, struct Page **store);
+int unmap_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
+int unmap_range_gather(struct tlb_gather *tlb, uintptr_t start, uintptr_t end);
 void exit_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
-int copy_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end, bool share);
+void share_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end);
+int unshare_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
+int protect_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
+int huge_split(pde_t *pgdir, uintptr_t la);
+bool pse_enabled(void);
 
 void print_pgdir(void);
 
@@ -75,12 +106,33 @@ void print_pgdir(void);
             (void *) (__m_pa + KERNBASE);                               \
         })
 
+/* *
+ * The memmap is sparse. Physical memory is cut into sections of PTSIZE, and
+ * pages[] only holds the struct Pages of the sections that have E820_ARM
+ * memory, PAGES_PER_SECTION of them per section, in address order.
+ * section_index[] gives the place of a section in pages[] (in sections),
+ * section_nr[] goes back from that place to the section number.
+ * */
+#define SECTION_SHIFT               PTSHIFT
+#define SECTION_PAGE_SHIFT          (SECTION_SHIFT - PGSHIFT)
+#define SECTION_SIZE                (1 << SECTION_SHIFT)
+#define PAGES_PER_SECTION           (1 << SECTION_PAGE_SHIFT)
+#define NR_SECTIONS                 (KMEMSIZE >> SECTION_SHIFT)
+#define SECTION_NONE                0xFFFF
+
+struct anon_vma;
+
 extern struct Page *pages;
+extern struct anon_vma **page_anon;
 extern size_t npage;
+extern size_t nr_memmap;
+extern uint16_t section_index[NR_SECTIONS];
+extern uint16_t section_nr[NR_SECTIONS];
 
 static inline ppn_t
 page2ppn(struct Page *page) {
-    return page - pages;
+    size_t idx = page - pages;
+    return ((ppn_t)section_nr[idx >> SECTION_PAGE_SHIFT] << SECTION_PAGE_SHIFT) | (idx & (PAGES_PER_SECTION - 1));
 }
 
 static inline uintptr_t
@@ -90,10 +142,10 @@ page2pa(struct Page *page) {
 
 static inline struct Page *
 pa2page(uintptr_t pa) {
-    if (PPN(pa) >= npage) {
+    if (PPN(pa) >= npage || section_index[pa >> SECTION_SHIFT] == SECTION_NONE) {
         panic("pa2page called with invalid pa");
     }
-    return &pages[PPN(pa)];
+    return &pages[((size_t)section_index[pa >> SECTION_SHIFT] << SECTION_PAGE_SHIFT) | (PPN(pa) & (PAGES_PER_SECTION - 1))];
 }
 
 static inline void *
@@ -114,11 +166,33 @@ pte2page(pte_t pte) {
     return pa2page(PTE_ADDR(pte));
 }
 
+// pte_pa - the physical address pte maps la to, pte is a PTE or a PDE with PTE_PS
+static inline uintptr_t
+pte_pa(pte_t pte, uintptr_t la) {
+    if (pte & PTE_PS) {
+        return PDE_PS_ADDR(pte) | (la & (PTSIZE - 1) & ~(PGSIZE - 1));
+    }
+    return PTE_ADDR(pte);
+}
+
 static inline struct Page *
 pde2page(pde_t pde) {
     return pa2page(PDE_ADDR(pde));
 }
 
+// pde_shared - a user PDE without PTE_W maps a page table that fork left
+//            - shared with other processes, see share_range
+static inline bool
+pde_shared(pde_t pde) {
+    return (pde & (PTE_P | PTE_U | PTE_W | PTE_PS)) == (PTE_P | PTE_U);
+}
+
+// pde_huge - a user PDE with PTE_PS maps a 4MB page of anonymous memory, see huge_split
+static inline bool
+pde_huge(pde_t pde) {
+    return (pde & (PTE_P | PTE_U | PTE_PS)) == (PTE_P | PTE_U | PTE_PS);
+}
+
 static inline int
 page_ref(struct Page *page) {
     return page->ref;
@@ -141,6 +215,30 @@ page_ref_dec(struct Page *page) {
     return page->ref;
 }
 
+// page_pra_vaddr - the la a swappable page is mapped at, kept in the high bits of flags
+static inline uintptr_t
+page_pra_vaddr(struct Page *page) {
+    return page->flags & ~(PGSIZE - 1);
+}
+
+static inline void
+set_page_pra_vaddr(struct Page *page, uintptr_t la) {
+    page->flags = (page->flags & (PGSIZE - 1)) | ROUNDDOWN(la, PGSIZE);
+}
+
+// tlb_gather_add - la has to leave the TLB at tlb_finish
+static inline void
+tlb_gather_add(struct tlb_gather *tlb, uintptr_t la) {
+    if (tlb->active) {
+        if (la < tlb->start) {
+            tlb->start = la;
+        }
+        if (la + PGSIZE > tlb->end) {
+            tlb->end = la + PGSIZE;
+        }
+    }
+}
+
 extern char bootstack[], bootstacktop[];
 
 #endif /* !__KERN_MM_PMM_H__ */
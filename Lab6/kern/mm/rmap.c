@@ -0,0 +1,167 @@
+#include <defs.h>
+#include <x86.h>
+#include <list.h>
+#include <memlayout.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <swap.h>
+#include <rmap.h>
+#include <kmalloc.h>
+#include <sync.h>
+#include <error.h>
+#include <assert.h>
+
+//anon_vma_create - give a new mm a family of its own
+int
+anon_vma_create(struct mm_struct *mm) {
+    struct anon_vma *anon_vma;
+    if ((anon_vma = kmalloc(sizeof(struct anon_vma))) == NULL) {
+        return -E_NO_MEM;
+    }
+    list_init(&(anon_vma->mm_list));
+    list_add(&(anon_vma->mm_list), &(mm->anon_link));
+    mm->anon_vma = anon_vma;
+    return 0;
+}
+
+//anon_vma_fork - to is a copy of from (dup_mmap) and joins its family.
+//              - to hasn't mapped anything yet, so its own anon_vma is empty.
+void
+anon_vma_fork(struct mm_struct *to, struct mm_struct *from) {
+    anon_vma_exit(to);
+    list_add(&(from->anon_vma->mm_list), &(to->anon_link));
+    to->anon_vma = from->anon_vma;
+}
+
+//anon_vma_exit - mm leaves its family, the last one frees the anon_vma
+void
+anon_vma_exit(struct mm_struct *mm) {
+    struct anon_vma *anon_vma = mm->anon_vma;
+    if (anon_vma != NULL) {
+        list_del(&(mm->anon_link));
+        if (list_empty(&(anon_vma->mm_list))) {
+            kfree(anon_vma);
+        }
+        mm->anon_vma = NULL;
+    }
+}
+
+//rmap_pte - the PTE (or the PDE of a 4MB page) that maps page at la in mm, or NULL
+static pte_t *
+rmap_pte(struct mm_struct *mm, struct Page *page, uintptr_t la) {
+    pte_t *ptep = get_pte(mm->pgdir, la, 0);
+    if (ptep != NULL && (*ptep & PTE_P)) {
+        uintptr_t pa = (*ptep & PTE_PS) ? PDE_PS_ADDR(*ptep) + (la & (PTSIZE - 1)) : PTE_ADDR(*ptep);
+        if (pa2page(pa) == page) {
+            return ptep;
+        }
+    }
+    return NULL;
+}
+
+//rmap_walk - call fn for every mm of the family of the swappable page that maps it,
+//          - until fn returns nonzero, and return that. the mms other than self
+//          - are try_locked, one that its owner holds (e.g. in dup_mmap) is skipped.
+int
+rmap_walk(struct Page *page, struct mm_struct *self, rmap_fn_t fn, void *arg) {
+    struct anon_vma *anon_vma = page_anon_vma(page);
+    if (anon_vma == NULL) {
+        return 0;
+    }
+    uintptr_t la = page_pra_vaddr(page);
+    list_entry_t *list = &(anon_vma->mm_list), *le = list;
+    int ret = 0;
+    while (ret == 0 && (le = list_next(le)) != list) {
+        struct mm_struct *mm = le2mm(le, anon_link);
+        // an exiting mm may have no page table any more
+        if (mm->pgdir == NULL || (mm != self && !try_lock(&(mm->mm_lock)))) {
+            continue;
+        }
+        pte_t *ptep = rmap_pte(mm, page, la);
+        if (ptep != NULL) {
+            ret = fn(mm, page, ptep, la, arg);
+        }
+        if (mm != self) {
+            unlock(&(mm->mm_lock));
+        }
+    }
+    return ret;
+}
+
+//unmap_one - make the mapping of page in mm hold the swap entry *arg instead
+static int
+unmap_one(struct mm_struct *mm, struct Page *page, pte_t *ptep, uintptr_t la, void *arg) {
+    swap_entry_t entry = *(swap_entry_t *)arg;
+    if (*ptep & PTE_PS) {
+        // this mm keeps its mapping if the 4MB page can't be split
+        if (huge_split(mm->pgdir, la) != 0) {
+            return 0;
+        }
+        // the split queues the pages of a queued head, the page is going away
+        swap_remove_page(page);
+        ptep = get_pte(mm->pgdir, la, 0);
+    }
+    swap_duplicate(entry);
+    *ptep = entry;
+    pde_t pde = mm->pgdir[PDX(la)];
+    if (pde_shared(pde) || page_ref(pde2page(pde)) > 1) {
+        // the page table is shared since fork and the current process may be
+        // another holder of it, with the PTE in its TLB. the family maps the
+        // page at la everywhere, so drop la whatever pgdir is in CR3.
+        invlpg((void *)la);
+    }
+    else {
+        tlb_invalidate(mm->pgdir, la);
+    }
+    return page_ref_dec(page) == 0;
+}
+
+//try_to_unmap - replace every mapping of page by the swap entry, which gets one
+//             - hold per PTE. self is the mm the page was taken from, its caller
+//             - holds it already. return nonzero once the last mapping is gone,
+//             - an mm locked by its owner may still map the page.
+int
+try_to_unmap(struct Page *page, swap_entry_t entry, struct mm_struct *self) {
+    assert(!PageSwappable(page));
+    return rmap_walk(page, self, unmap_one, &entry);
+}
+
+//rmap_keep - swap_out couldn't unmap page from an mm that its owner holds: queue it
+//          - in that mm again, so it can be swapped out later. the mm isn't locked
+//          - here, the kernel isn't preemptive and its queue is only a list.
+void
+rmap_keep(struct Page *page) {
+    struct anon_vma *anon_vma = page_anon_vma(page);
+    uintptr_t la = page_pra_vaddr(page);
+    list_entry_t *list = &(anon_vma->mm_list), *le = list;
+    while ((le = list_next(le)) != list) {
+        struct mm_struct *mm = le2mm(le, anon_link);
+        if (mm->pgdir != NULL && rmap_pte(mm, page, la) != NULL) {
+            swap_map_swappable(mm, la, page, 0);
+            return;
+        }
+    }
+}
+
+//requeue_one - queue page in the first mm that maps it, except the one of pgdir *arg
+static int
+requeue_one(struct mm_struct *mm, struct Page *page, pte_t *ptep, uintptr_t la, void *arg) {
+    if (mm->pgdir == (pde_t *)arg) {
+        return 0;
+    }
+    swap_map_swappable(mm, la, page, 0);
+    return 1;
+}
+
+//rmap_requeue - pgdir is dropping its mapping of page, which is still mapped by
+//             - others. a queued page moves to the queue of an mm that keeps it,
+//             - so it can still be swapped out, and a queued page is always
+//             - mapped by its mm (see do_pgfault).
+void
+rmap_requeue(struct Page *page, pde_t *pgdir) {
+    if (PageSwappable(page)) {
+        swap_remove_page(page);
+        rmap_walk(page, NULL, requeue_one, pgdir);
+    }
+}
+
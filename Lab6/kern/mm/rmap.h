@@ -0,0 +1,53 @@
+#ifndef __KERN_MM_RMAP_H__
+#define __KERN_MM_RMAP_H__
+
+#include <defs.h>
+#include <list.h>
+#include <memlayout.h>
+#include <pmm.h>
+
+struct mm_struct;
+
+/* *
+ * Reverse mapping of anonymous pages
+ *
+ * fork keeps the addresses of the parent, so a page that is shared copy on
+ * write, or through a page table shared since fork, is only ever mapped by
+ * the mms of one fork family, and always at the same la, the pra_vaddr of
+ * the page. An anon_vma is such a family: the list of its mms. A page queued
+ * for swap (swap_map_swappable) records the anon_vma of its mm in page_anon[],
+ * so every (mm, la) that maps it is found by looking up pra_vaddr in the few
+ * mms of the family, without knowing which mm the page came from.
+ *
+ * An mm gets its own anon_vma in mm_create, and trades it for the one of its
+ * parent in dup_mmap, before it maps anything. exec starts a new family.
+ * */
+struct anon_vma {
+    list_entry_t mm_list;       // the mms of the family, linked by anon_link
+};
+
+// called for each mapping found by rmap_walk, a nonzero return ends the walk
+typedef int (*rmap_fn_t)(struct mm_struct *mm, struct Page *page, pte_t *ptep, uintptr_t la, void *arg);
+
+// page_anon_vma - the family of mms that may map page, valid while the page is swappable
+static inline struct anon_vma *
+page_anon_vma(struct Page *page) {
+    return page_anon[page - pages];
+}
+
+static inline void
+set_page_anon_vma(struct Page *page, struct anon_vma *anon_vma) {
+    page_anon[page - pages] = anon_vma;
+}
+
+int anon_vma_create(struct mm_struct *mm);
+void anon_vma_fork(struct mm_struct *to, struct mm_struct *from);
+void anon_vma_exit(struct mm_struct *mm);
+
+int rmap_walk(struct Page *page, struct mm_struct *self, rmap_fn_t fn, void *arg);
+int try_to_unmap(struct Page *page, swap_entry_t entry, struct mm_struct *self);
+void rmap_keep(struct Page *page);
+void rmap_requeue(struct Page *page, pde_t *pgdir);
+
+#endif /* !__KERN_MM_RMAP_H__ */
+
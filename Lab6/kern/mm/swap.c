@@ -6,8 +6,11 @@
 #include <memlayout.h>
 #include <pmm.h>
 #include <mmu.h>
-#include <default_pmm.h>
 #include <kdebug.h>
+#include <kmalloc.h>
+#include <proc.h>
+#include <sync.h>
+#include <rmap.h>
 
 // the valid vaddr for check is between 0~CHECK_VALID_VADDR-1
 #define CHECK_VALID_VIR_PAGE_NUM 5
@@ -18,9 +21,19 @@
 // the max access seq number
 #define MAX_SEQ_NO 10
 
+// the # of pages swapped out of one mm before swap_reclaim moves to the next one
+#define SWAP_CLUSTER 8
+
 static struct swap_manager *sm;
 size_t max_swap_offset;
 
+// swap_map[offset] is the # of PTEs holding the swap entry of offset, 0 means the slot is free
+static uint8_t *swap_map;
+static size_t swap_cursor;
+
+// kswapd - the kernel thread keeping the # of free pages above the low watermark
+struct proc_struct *kswapd = NULL;
+
 volatile int swap_init_ok = 0;
 
 unsigned int swap_page[CHECK_VALID_VIR_PAGE_NUM];
@@ -28,6 +41,7 @@ unsigned int swap_page[CHECK_VALID_VIR_PAGE_NUM];
 unsigned int swap_in_seq_no[MAX_SEQ_NO],swap_out_seq_no[MAX_SEQ_NO];
 
 static void check_swap(void);
+static void check_rmap(void);
 
 int
 swap_init(void)
@@ -38,6 +52,12 @@ swap_init(void)
      {
           panic("bad max_swap_offset %08x.\n", max_swap_offset);
      }
+     if ((swap_map = kmalloc(max_swap_offset)) == NULL)
+     {
+          panic("cannot alloc swap_map.\n");
+     }
+     memset(swap_map, 0, max_swap_offset);
+     swap_cursor = 0;
      
 
      sm = &swap_manager_fifo;
@@ -48,6 +68,8 @@ swap_init(void)
           swap_init_ok = 1;
           cprintf("SWAP: manager = %s\n", sm->name);
           check_swap();
+          check_rmap();
+          kswapd_init();
      }
 
      return r;
@@ -68,9 +90,110 @@ swap_tick_event(struct mm_struct *mm)
 int
 swap_map_swappable(struct mm_struct *mm, uintptr_t addr, struct Page *page, int swap_in)
 {
+     if (PageSwappable(page) || PageReserved(page)) {
+          //a reserved frame, e.g. shared program text, stays in memory
+          return 0;
+     }
+     set_page_pra_vaddr(page, addr);
+     set_page_anon_vma(page, mm->anon_vma);
+     SetPageSwappable(page);
      return sm->map_swappable(mm, addr, page, swap_in);
 }
 
+// swap_map_range - make the pages mapped in [start, end) of mm swappable, used when
+//                - do_pgfault takes a page table shared since fork for mm alone.
+//                - a 4MB page is queued by its head page.
+void
+swap_map_range(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+{
+     do {
+          pte_t *ptep = get_pte(mm->pgdir, start, 0);
+          if (ptep == NULL || pde_huge(*ptep)) {
+               if (ptep != NULL) {
+                    start = ROUNDDOWN(start, PTSIZE);
+                    swap_map_swappable(mm, start, pa2page(PDE_PS_ADDR(*ptep)), 0);
+               }
+               start = ROUNDDOWN(start + PTSIZE, PTSIZE);
+               continue ;
+          }
+          if (*ptep & PTE_P) {
+               swap_map_swappable(mm, start, pte2page(*ptep), 0);
+          }
+          start += PGSIZE;
+     } while (start != 0 && start < end);
+}
+
+// swap_remove_page - a mapping of page is gone, take it off the swap manager's list
+void
+swap_remove_page(struct Page *page)
+{
+     if (PageSwappable(page)) {
+          list_del(&(page->pra_page_link));
+          ClearPageSwappable(page);
+     }
+}
+
+// swap_split_page - the 4MB page starting at head is split (huge_split). if head is
+//                 - queued, its other n - 1 pages are queued right behind it.
+void
+swap_split_page(struct Page *head, size_t n)
+{
+     if (PageSwappable(head)) {
+          uintptr_t la = page_pra_vaddr(head);
+          list_entry_t *le = &(head->pra_page_link);
+          size_t i;
+          for (i = 1; i < n; i ++) {
+               struct Page *page = head + i;
+               if (!PageSwappable(page)) {
+                    set_page_pra_vaddr(page, la + i * PGSIZE);
+                    set_page_anon_vma(page, page_anon_vma(head));
+                    SetPageSwappable(page);
+                    list_add(le, &(page->pra_page_link));
+                    le = &(page->pra_page_link);
+               }
+          }
+     }
+}
+
+// swap_entry_alloc - get a free swap slot, try offset hint first, return 0 if the swap is full
+static swap_entry_t
+swap_entry_alloc(size_t hint)
+{
+     size_t i, offset = swap_cursor;
+     if (hint > 0 && hint < max_swap_offset && swap_map[hint] == 0) {
+          swap_map[hint] = 1;
+          return hint << 8;
+     }
+     for (i = 1; i < max_swap_offset; i ++) {
+          if (++ offset >= max_swap_offset) {
+               offset = 1;
+          }
+          if (swap_map[offset] == 0) {
+               swap_map[offset] = 1, swap_cursor = offset;
+               return offset << 8;
+          }
+     }
+     return 0;
+}
+
+// swap_duplicate - one more PTE holds entry, e.g. a page table was copied on fault
+void
+swap_duplicate(swap_entry_t entry)
+{
+     size_t offset = swap_offset(entry);
+     assert(swap_map[offset] > 0 && swap_map[offset] < 0xFF);
+     swap_map[offset] ++;
+}
+
+// swap_free - a PTE holding entry is gone, the slot is free after the last one
+void
+swap_free(swap_entry_t entry)
+{
+     size_t offset = swap_offset(entry);
+     assert(swap_map[offset] > 0);
+     swap_map[offset] --;
+}
+
 int
 swap_set_unswappable(struct mm_struct *mm, uintptr_t addr)
 {
@@ -82,8 +205,8 @@ volatile unsigned int swap_out_num=0;
 int
 swap_out(struct mm_struct *mm, int n, int in_tick)
 {
-     int i;
-     for (i = 0; i != n; ++ i)
+     int i = 0;
+     while (i != n)
      {
           uintptr_t v;
           //struct Page **ptr_page=NULL;
@@ -91,33 +214,137 @@ swap_out(struct mm_struct *mm, int n, int in_tick)
           // cprintf("i %d, SWAP: call swap_out_victim\n",i);
           int r = sm->swap_out_victim(mm, &page, in_tick);
           if (r != 0) {
-                    cprintf("i %d, swap_out: call swap_out_victim failed\n",i);
+                  //no swappable page left in this mm
                   break;
           }          
           //assert(!PageReserved(page));
+          ClearPageSwappable(page);
 
           //cprintf("SWAP: choose victim page 0x%08x\n", page);
           
-          v=page->pra_vaddr; 
+          v=page_pra_vaddr(page); 
           pte_t *ptep = get_pte(mm->pgdir, v, 0);
-          assert((*ptep & PTE_P) != 0);
+          if (ptep != NULL && pde_huge(*ptep)) {
+                  //a 4MB page is written out page by page, all of them go back
+                  //into the queue once it is split
+                  if (huge_split(mm->pgdir, v) != 0) {
+                          swap_map_swappable(mm, v, page, 0);
+                          break;
+                  }
+                  swap_map_range(mm, ROUNDDOWN(v, PTSIZE), ROUNDDOWN(v, PTSIZE) + PTSIZE);
+                  continue;
+          }
+          assert(ptep != NULL && (*ptep & PTE_P) != 0 && pte2page(*ptep) == page);
 
-          if (swapfs_write( (page->pra_vaddr/PGSIZE+1)<<8, page) != 0) {
+          swap_entry_t entry = swap_entry_alloc(v/PGSIZE+1);
+          if (entry == 0 || swapfs_write(entry, page) != 0) {
                     cprintf("SWAP: failed to save\n");
-                    sm->map_swappable(mm, v, page, 0);
-                    continue;
+                    if (entry != 0) {
+                         swap_free(entry);
+                    }
+                    swap_map_swappable(mm, v, page, 0);
+                    break;
           }
           else {
-                    cprintf("swap_out: i %d, store page in vaddr 0x%x to disk swap entry %d\n", i, v, page->pra_vaddr/PGSIZE+1);
-                    *ptep = (page->pra_vaddr/PGSIZE+1)<<8;
+                    cprintf("swap_out: i %d, store page in vaddr 0x%x to disk swap entry %d\n", i, v, swap_offset(entry));
+                    //a copy on write page goes from the other mms of the fork
+                    //family too, then the slot only has the holds of the PTEs
+                    try_to_unmap(page, entry, mm);
+                    swap_free(entry);
+                    if (page_ref(page) != 0) {
+                         //an mm locked by its owner still maps the page,
+                         //it stays in memory, in the swap queue of that mm
+                         rmap_keep(page);
+                         continue;
+                    }
                     free_page(page);
           }
-          
-          tlb_invalidate(mm->pgdir, v);
+          i ++;
      }
      return i;
 }
 
+// swap_reclaim - swap out up to n pages, SWAP_CLUSTER at a time from the mm of
+//              - every process in turn, return the # of pages reclaimed.
+//              - an mm locked by its owner (dup_mmap, a syscall, or do_pgfault while it
+//              - allocates) is skipped.
+int
+swap_reclaim(int n)
+{
+     if (check_mm_struct != NULL) {
+          return swap_out(check_mm_struct, n, 0);
+     }
+     int nr = 0, progress;
+     do {
+          progress = 0;
+          list_entry_t *le = &proc_list;
+          while (nr < n && (le = list_next(le)) != &proc_list) {
+               struct mm_struct *mm = le2proc(le, list_link)->mm;
+               if (mm != NULL && try_lock(&(mm->mm_lock))) {
+                    int r = swap_out(mm, (n - nr < SWAP_CLUSTER) ? n - nr : SWAP_CLUSTER, 0);
+                    unlock(&(mm->mm_lock));
+                    nr += r, progress += r;
+               }
+          }
+     } while (nr < n && progress > 0);
+     return nr;
+}
+
+// kswapd_main - sleep until the # of free pages drops below the low watermark,
+//             - then reclaim until it is back at the high watermark
+static int
+kswapd_main(void *arg)
+{
+     while (1) {
+          size_t nr_free;
+          while ((nr_free = nr_free_pages()) < high_free_pages) {
+               if (swap_reclaim(high_free_pages - nr_free) == 0) {
+                    break;
+               }
+               if (current->need_resched) {
+                    schedule();
+               }
+          }
+          bool intr_flag;
+          local_intr_save(intr_flag);
+          {
+               current->state = PROC_SLEEPING;
+               current->wait_state = WT_KSWAPD;
+          }
+          local_intr_restore(intr_flag);
+          schedule();
+     }
+     return 0;
+}
+
+void
+kswapd_init(void)
+{
+     int pid = kernel_thread(kswapd_main, NULL, 0);
+     if (pid <= 0) {
+          panic("create kswapd failed.\n");
+     }
+     kswapd = find_proc(pid);
+     set_proc_name(kswapd, "kswapd");
+}
+
+// swap_balance - alloc_pages left nr_free pages free: wake up kswapd below the low
+//              - watermark, and reclaim right here below the min watermark.
+//              - before kswapd exists (check_swap), reclaim only happens when alloc_pages fails.
+void
+swap_balance(size_t nr_free)
+{
+     if (kswapd == NULL || current == kswapd) {
+          return ;
+     }
+     if (nr_free < low_free_pages && kswapd->state == PROC_SLEEPING && kswapd->wait_state == WT_KSWAPD) {
+          wakeup_proc(kswapd);
+     }
+     if (nr_free < min_free_pages) {
+          swap_reclaim(min_free_pages - nr_free);
+     }
+}
+
 int
 swap_in(struct mm_struct *mm, uintptr_t addr, struct Page **ptr_result)
 {
@@ -133,6 +360,7 @@ swap_in(struct mm_struct *mm, uintptr_t addr, struct Page **ptr_result)
         assert(r!=0);
      }
      cprintf("swap_in: load disk swap entry %d with swap_page in vadr 0x%x\n", (*ptep)>>8, addr);
+     swap_free(*ptep);
      *ptr_result=result;
      return 0;
 }
@@ -171,24 +399,11 @@ struct Page * check_rp[CHECK_VALID_PHY_PAGE_NUM];
 pte_t * check_ptep[CHECK_VALID_PHY_PAGE_NUM];
 unsigned int check_swap_addr[CHECK_VALID_VIR_PAGE_NUM];
 
-extern free_area_t free_area;
-
-#define free_list (free_area.free_list)
-#define nr_free (free_area.nr_free)
-
 static void
 check_swap(void)
 {
     //backup mem env
-     int ret, count = 0, total = 0, i;
-     list_entry_t *le = &free_list;
-     while ((le = list_next(le)) != &free_list) {
-        struct Page *p = le2page(le, page_link);
-        assert(PageProperty(p));
-        count ++, total += p->property;
-     }
-     assert(total == nr_free_pages());
-     cprintf("BEGIN check_swap: count %d, total %d\n",count,total);
+     int ret, i;
      
      //now we set the phy pages env     
      struct mm_struct *mm = mm_create();
@@ -198,6 +413,9 @@ check_swap(void)
      assert(check_mm_struct == NULL);
 
      check_mm_struct = mm;
+     //every access below has to fault, in the order the swap manager expects
+     unsigned int fault_around_store = fault_around_pages;
+     fault_around_pages = 0;
 
      pde_t *pgdir = mm->pgdir = boot_pgdir;
      assert(pgdir[0] == 0);
@@ -207,6 +425,9 @@ check_swap(void)
 
      insert_vma_struct(mm, vma);
 
+     size_t total = nr_free_pages();
+     cprintf("BEGIN check_swap: total %d\n",total);
+
      //setup the temp Page Table vaddr 0~4MB
      cprintf("setup Page Table for vaddr 0X1000, so alloc a page\n");
      pte_t *temp_ptep=NULL;
@@ -219,18 +440,24 @@ check_swap(void)
           assert(check_rp[i] != NULL );
           assert(!PageProperty(check_rp[i]));
      }
-     list_entry_t free_list_store = free_list;
-     list_init(&free_list);
-     assert(list_empty(&free_list));
-     
-     //assert(alloc_page() == NULL);
+
+     //hold every other free page, so that only check_rp can be allocated.
+     //this works with any pmm_manager, the free lists are never touched.
+     list_entry_t held_list;
+     list_init(&held_list);
+     size_t nr_held = 0;
+     while (nr_free_pages() > 0) {
+          struct Page *p = alloc_page();
+          assert(p != NULL);
+          list_add(&held_list, &(p->page_link));
+          nr_held ++;
+     }
      
-     unsigned int nr_free_store = nr_free;
-     nr_free = 0;
-     for (i=0;i<CHECK_VALID_PHY_PAGE_NUM;i++) {
+     //free in reverse order, the LIFO page cache then hands out check_rp[0] first
+     for (i=CHECK_VALID_PHY_PAGE_NUM-1;i>=0;i--) {
         free_pages(check_rp[i],1);
      }
-     assert(nr_free==CHECK_VALID_PHY_PAGE_NUM);
+     assert(nr_free_pages()==CHECK_VALID_PHY_PAGE_NUM);
      
      cprintf("set up init env for check_swap begin!\n");
      //setup initial vir_page<->phy_page environment for page relpacement algorithm 
@@ -239,7 +466,7 @@ check_swap(void)
      pgfault_num=0;
      
      check_content_set();
-     assert( nr_free == 0);         
+     assert(nr_free_pages() == 0);         
      for(i = 0; i<MAX_SEQ_NO ; i++) 
          swap_out_seq_no[i]=swap_in_seq_no[i]=-1;
      
@@ -257,28 +484,90 @@ check_swap(void)
      assert(ret==0);
      
      //restore kernel mem env
-     for (i=0;i<CHECK_VALID_PHY_PAGE_NUM;i++) {
-         free_pages(check_rp[i],1);
-     } 
+     for (i=0;i<CHECK_VALID_VIR_PAGE_NUM;i++) {
+         page_remove(pgdir, (i+1)*0x1000);
+     }
+     assert(nr_free_pages()==CHECK_VALID_PHY_PAGE_NUM);
 
-     //free_page(pte2page(*temp_ptep));
-    free_page(pa2page(pgdir[0]));
+     free_page(pa2page(pgdir[0]));
      pgdir[0] = 0;
      mm->pgdir = NULL;
      mm_destroy(mm);
      check_mm_struct = NULL;
+     fault_around_pages = fault_around_store;
      
-     nr_free = nr_free_store;
-     free_list = free_list_store;
-
-     
-     le = &free_list;
-     while ((le = list_next(le)) != &free_list) {
-         struct Page *p = le2page(le, page_link);
-         count --, total -= p->property;
+     list_entry_t *le;
+     while ((le = list_next(&held_list)) != &held_list) {
+         list_del(le);
+         free_page(le2page(le, page_link));
+         nr_held --;
      }
-     cprintf("count is %d, total is %d\n",count,total);
-     //assert(count == 0);
+     assert(nr_held == 0);
+
+     cprintf("total is %d\n",nr_free_pages());
+     assert(total == nr_free_pages());
      
      cprintf("check_swap() succeeded!\n");
 }
+
+// check_rmap - a page shared by two mms of a fork family moves to the queue of
+//            - the one that keeps it, and is swapped out of both at once
+static void
+check_rmap(void)
+{
+     size_t nr_free_store = nr_free_pages();
+     struct mm_struct *mm1 = mm_create(), *mm2 = mm_create();
+     assert(mm1 != NULL && mm2 != NULL);
+     anon_vma_fork(mm2, mm1);
+     assert(mm1->anon_vma == mm2->anon_vma);
+
+     struct Page *pd1 = alloc_zeroed_page(), *pd2 = alloc_zeroed_page(), *page = alloc_page();
+     assert(pd1 != NULL && pd2 != NULL && page != NULL);
+     mm1->pgdir = page2kva(pd1), mm2->pgdir = page2kva(pd2);
+
+     uintptr_t la = ROUNDUP(USERBASE, PTSIZE);
+     assert(page_insert(mm1->pgdir, page, la, PTE_U) == 0);
+     assert(page_insert(mm2->pgdir, page, la, PTE_U) == 0);
+     swap_map_swappable(mm1, la, page, 0);
+     assert(page_ref(page) == 2 && page_anon_vma(page) == mm1->anon_vma);
+
+     // mm1 unmaps it, mm2 still maps it and queues it
+     page_remove(mm1->pgdir, la);
+     assert(page_ref(page) == 1 && PageSwappable(page));
+     assert(list_empty(&(mm1->pra_list_head)));
+     assert(list_next(&(mm2->pra_list_head)) == &(page->pra_page_link));
+
+     // both PTEs get the swap entry, one hold each
+     assert(page_insert(mm1->pgdir, page, la, PTE_U) == 0);
+     assert(swap_out(mm2, 1, 0) == 1);
+     pte_t *ptep1 = get_pte(mm1->pgdir, la, 0), *ptep2 = get_pte(mm2->pgdir, la, 0);
+     assert(ptep1 != NULL && ptep2 != NULL);
+     assert(!(*ptep1 & PTE_P) && *ptep1 != 0 && *ptep1 == *ptep2);
+     size_t offset = swap_offset(*ptep1);
+     assert(swap_map[offset] == 2);
+
+     // mm1 is locked by its owner: it keeps the page, which moves to its queue
+     assert((page = alloc_page()) != NULL);
+     assert(page_insert(mm1->pgdir, page, la + PGSIZE, PTE_U) == 0);
+     assert(page_insert(mm2->pgdir, page, la + PGSIZE, PTE_U) == 0);
+     swap_map_swappable(mm2, la + PGSIZE, page, 0);
+     lock_mm(mm1);
+     assert(swap_out(mm2, 1, 0) == 0);
+     unlock_mm(mm1);
+     assert(page_ref(page) == 1 && PageSwappable(page) && list_empty(&(mm2->pra_list_head)));
+     assert(list_next(&(mm1->pra_list_head)) == &(page->pra_page_link));
+     ptep2 = get_pte(mm2->pgdir, la + PGSIZE, 0);
+     assert(ptep2 != NULL && !(*ptep2 & PTE_P) && swap_map[swap_offset(*ptep2)] == 1);
+
+     exit_range(mm1->pgdir, la, la + PTSIZE);
+     exit_range(mm2->pgdir, la, la + PTSIZE);
+     assert(swap_map[offset] == 0);
+     free_page(pd1);
+     free_page(pd2);
+     mm1->pgdir = mm2->pgdir = NULL;
+     mm_destroy(mm1);
+     mm_destroy(mm2);
+     assert(nr_free_store == nr_free_pages());
+
+     cprintf("check_rmap() succeeded!\n");
+}
@@ -50,14 +50,25 @@ struct swap_manager
      int (*check_swap)(void);     
 };
 
+struct proc_struct;
+
 extern volatile int swap_init_ok;
+extern struct proc_struct *kswapd;
 int swap_init(void);
 int swap_init_mm(struct mm_struct *mm);
 int swap_tick_event(struct mm_struct *mm);
 int swap_map_swappable(struct mm_struct *mm, uintptr_t addr, struct Page *page, int swap_in);
+void swap_map_range(struct mm_struct *mm, uintptr_t start, uintptr_t end);
+void swap_remove_page(struct Page *page);
+void swap_split_page(struct Page *head, size_t n);
 int swap_set_unswappable(struct mm_struct *mm, uintptr_t addr);
 int swap_out(struct mm_struct *mm, int n, int in_tick);
 int swap_in(struct mm_struct *mm, uintptr_t addr, struct Page **ptr_result);
+void swap_duplicate(swap_entry_t entry);
+void swap_free(swap_entry_t entry);
+int swap_reclaim(int n);
+void kswapd_init(void);
+void swap_balance(size_t nr_free);
 
 //#define MEMBER_OFFSET(m,t) ((int)(&((t *)0)->m))
 //#define FROM_MEMBER(m,t,a) ((t *)((char *)(a) - MEMBER_OFFSET(m,t)))
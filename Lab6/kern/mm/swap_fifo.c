@@ -5,6 +5,7 @@
 #include <swap.h>
 #include <swap_fifo.h>
 #include <list.h>
+#include <error.h>
 
 /* [wikipedia]The simplest Page Replacement Algorithm(PRA) is a FIFO algorithm. The first-in, first-out
  * page replacement algorithm is a low-overhead algorithm that requires little book-keeping on
@@ -17,7 +18,7 @@
  *
  * Details of FIFO PRA
  * (1) Prepare: In order to implement FIFO PRA, we should manage all swappable pages, so we can
- *              link these pages into pra_list_head according the time order. At first you should
+ *              link these pages into mm->pra_list_head according the time order. At first you should
  *              be familiar to the struct list in list.h. struct list is a simple doubly linked list
  *              implementation. You should know howto USE: list_init, list_add(list_add_after),
  *              list_add_before, list_del, list_next, list_prev. Another tricky method is to transform
@@ -25,16 +26,16 @@
  *              le2page (in memlayout.h), (in future labs: le2vma (in vmm.h), le2proc (in proc.h),etc.
  */
 
-list_entry_t pra_list_head;
 /*
- * (2) _fifo_init_mm: init pra_list_head and let  mm->sm_priv point to the addr of pra_list_head.
- *              Now, From the memory control struct mm_struct, we can access FIFO PRA
+ * (2) _fifo_init_mm: init mm->pra_list_head and let  mm->sm_priv point to the addr of it.
+ *              Now, From the memory control struct mm_struct, we can access FIFO PRA.
+ *              Every mm has its own queue, so kswapd can pick victims from any process.
  */
 static int
 _fifo_init_mm(struct mm_struct *mm)
 {     
-     list_init(&pra_list_head);
-     mm->sm_priv = &pra_list_head;
+     list_init(&(mm->pra_list_head));
+     mm->sm_priv = &(mm->pra_list_head);
      //cprintf(" mm->sm_priv %x in fifo_init_mm\n",mm->sm_priv);
      return 0;
 }
@@ -71,7 +72,10 @@ _fifo_swap_out_victim(struct mm_struct *mm, struct Page ** ptr_page, int in_tick
     /*LAB3 EXERCISE 2: YOUR CODE*/ 
     list_entry_t *prev_page=head->prev;//找到最早进入队列的节点
     //因为是双向链表，所以head->prev(即链表尾部)永远是最早进入的节点
-    assert(head!=prev_page);//判断是否就是头节点对应的页
+    if (head==prev_page) {//队列为空，该mm中没有可换出的页
+        *ptr_page=NULL;
+        return -E_NO_MEM;
+    }
     struct Page *page=le2page(prev_page,pra_page_link);//得到节点所属的Page结构
     list_del(prev_page);//对应英文注释(1)  unlink the  earliest arrival page in front of pra_list_head queue
     //从链表上删除刚刚找到的最早进入队列的节点prev_page
@@ -0,0 +1,315 @@
+#include <pmm.h>
+#include <list.h>
+#include <string.h>
+#include <stdio.h>
+#include <tlsf_pmm.h>
+
+/* TLSF: Two-Level Segregated Fit (M. Masmano et al., ECRTS 2004)
+ *
+ * A free extent is a run of contiguous free pages. Only its head page is
+ * linked into a free list; the head and the tail page both carry
+ * PG_property and property == length of the extent (boundary tags), so the
+ * neighbours of a freed range can be found in O(1) and merged.
+ *
+ * Extents are binned by size in two levels:
+ *   first level  fl : the power of two range of the size, [2^k, 2^(k+1))
+ *   second level sl : TLSF_SL_COUNT linear slices of that range
+ * Sizes below TLSF_SL_COUNT get one exact list each (fl == 0, sl == size).
+ * A bit in fl_bitmap/sl_bitmap[fl] is set iff the matching list is not
+ * empty, so the smallest non-empty class that is big enough is found with
+ * two bsf instructions.
+ *
+ * alloc_pages(n) rounds n up to the next class boundary, so any extent in
+ * the class found is large enough (good fit), cuts n pages from the front
+ * and reinserts the rest. free_pages(base, n) merges with the neighbour
+ * extents and inserts the result. Both are O(1).
+ */
+
+static list_entry_t tlsf_list[TLSF_FL_COUNT][TLSF_SL_COUNT];
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[TLSF_FL_COUNT];
+static size_t tlsf_nr_free;
+
+// tlsf_ffs - index of the least significant set bit, x must not be 0
+static inline int
+tlsf_ffs(uint32_t x) {
+    int bit;
+    asm ("bsfl %1, %0" : "=r" (bit) : "rm" (x));
+    return bit;
+}
+
+// tlsf_fls - index of the most significant set bit, x must not be 0
+static inline int
+tlsf_fls(uint32_t x) {
+    int bit;
+    asm ("bsrl %1, %0" : "=r" (bit) : "rm" (x));
+    return bit;
+}
+
+// tlsf_mapping - the (fl, sl) class that an extent of n pages is kept in
+static inline void
+tlsf_mapping(size_t n, int *fl, int *sl) {
+    if (n < TLSF_SL_COUNT) {
+        *fl = 0, *sl = n;
+    }
+    else {
+        int bit = tlsf_fls(n);
+        *sl = (n >> (bit - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+        *fl = bit - TLSF_SL_SHIFT + 1;
+    }
+}
+
+// tlsf_mapping_search - the first class whose extents are all >= n pages
+static inline void
+tlsf_mapping_search(size_t n, int *fl, int *sl) {
+    if (n >= TLSF_SL_COUNT) {
+        n += (1 << (tlsf_fls(n) - TLSF_SL_SHIFT)) - 1;
+    }
+    tlsf_mapping(n, fl, sl);
+}
+
+static inline void
+tlsf_mark(struct Page *base, size_t n) {
+    base->property = n, base[n - 1].property = n;
+    SetPageProperty(base);
+    SetPageProperty(base + n - 1);
+}
+
+static inline void
+tlsf_unmark(struct Page *base, size_t n) {
+    base->property = base[n - 1].property = 0;
+    ClearPageProperty(base);
+    ClearPageProperty(base + n - 1);
+}
+
+static void
+tlsf_insert(struct Page *base, size_t n) {
+    int fl, sl;
+    tlsf_mapping(n, &fl, &sl);
+    tlsf_mark(base, n);
+    list_add(&tlsf_list[fl][sl], &(base->page_link));
+    fl_bitmap |= (1 << fl);
+    sl_bitmap[fl] |= (1 << sl);
+}
+
+static void
+tlsf_remove(struct Page *base) {
+    int fl, sl;
+    size_t n = base->property;
+    tlsf_mapping(n, &fl, &sl);
+    list_del(&(base->page_link));
+    if (list_empty(&tlsf_list[fl][sl])) {
+        if ((sl_bitmap[fl] &= ~(1 << sl)) == 0) {
+            fl_bitmap &= ~(1 << fl);
+        }
+    }
+    tlsf_unmark(base, n);
+}
+
+// tlsf_find - get a free extent of at least n pages, or NULL
+static struct Page *
+tlsf_find(size_t n) {
+    int fl, sl;
+    tlsf_mapping_search(n, &fl, &sl);
+    if (fl < TLSF_FL_COUNT) {
+        uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+        if (sl_map == 0) {
+            uint32_t fl_map = (fl + 1 < TLSF_FL_COUNT) ? fl_bitmap & (~0U << (fl + 1)) : 0;
+            if (fl_map != 0) {
+                fl = tlsf_ffs(fl_map);
+                sl_map = sl_bitmap[fl];
+            }
+        }
+        if (sl_map != 0) {
+            sl = tlsf_ffs(sl_map);
+            return le2page(list_next(&tlsf_list[fl][sl]), page_link);
+        }
+    }
+    // rounding up skipped n's own class, which may still hold a big enough extent
+    tlsf_mapping(n, &fl, &sl);
+    list_entry_t *list = &tlsf_list[fl][sl], *le = list;
+    while ((le = list_next(le)) != list) {
+        struct Page *p = le2page(le, page_link);
+        if (p->property >= n) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void
+tlsf_init(void) {
+    int fl, sl;
+    for (fl = 0; fl < TLSF_FL_COUNT; fl ++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl ++) {
+            list_init(&tlsf_list[fl][sl]);
+        }
+        sl_bitmap[fl] = 0;
+    }
+    fl_bitmap = 0;
+    tlsf_nr_free = 0;
+}
+
+static void
+tlsf_free_extent(struct Page *base, size_t n) {
+    if (base != pages && PageProperty(base - 1)) {
+        struct Page *prev = base - base[-1].property;
+        n += prev->property;
+        tlsf_remove(prev);
+        base = prev;
+    }
+    if (base + n < pages + nr_memmap && PageProperty(base + n)) {
+        struct Page *next = base + n;
+        n += next->property;
+        tlsf_remove(next);
+    }
+    tlsf_insert(base, n);
+}
+
+static void
+tlsf_init_memmap(struct Page *base, size_t n) {
+    assert(n > 0);
+    struct Page *p = base;
+    for (; p != base + n; p ++) {
+        assert(PageReserved(p));
+        p->flags = p->property = 0;
+        set_page_ref(p, 0);
+    }
+    tlsf_free_extent(base, n);
+    tlsf_nr_free += n;
+}
+
+static struct Page *
+tlsf_alloc_pages(size_t n) {
+    assert(n > 0);
+    if (n > tlsf_nr_free) {
+        return NULL;
+    }
+    struct Page *page = tlsf_find(n);
+    if (page != NULL) {
+        size_t size = page->property;
+        tlsf_remove(page);
+        if (size > n) {
+            tlsf_insert(page + n, size - n);
+        }
+        tlsf_nr_free -= n;
+    }
+    return page;
+}
+
+static void
+tlsf_free_pages(struct Page *base, size_t n) {
+    assert(n > 0);
+    struct Page *p = base;
+    for (; p != base + n; p ++) {
+        assert(!PageReserved(p) && !PageProperty(p));
+        p->flags = 0;
+        set_page_ref(p, 0);
+    }
+    tlsf_free_extent(base, n);
+    tlsf_nr_free += n;
+}
+
+static size_t
+tlsf_nr_free_pages(void) {
+    return tlsf_nr_free;
+}
+
+// tlsf_check - the default_check scenario, run on an isolated 5-page extent
+static void
+tlsf_check(void) {
+    int fl, sl, count = 0;
+    size_t total = 0;
+    for (fl = 0; fl < TLSF_FL_COUNT; fl ++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl ++) {
+            list_entry_t *list = &tlsf_list[fl][sl], *le = list;
+            assert(list_empty(list) == !(sl_bitmap[fl] & (1 << sl)));
+            while ((le = list_next(le)) != list) {
+                struct Page *p = le2page(le, page_link);
+                int f, s;
+                tlsf_mapping(p->property, &f, &s);
+                assert(PageProperty(p) && f == fl && s == sl);
+                assert(PageProperty(p + p->property - 1) && p[p->property - 1].property == p->property);
+                count ++, total += p->property;
+            }
+        }
+        assert((sl_bitmap[fl] != 0) == !!(fl_bitmap & (1 << fl)));
+    }
+    assert(total == nr_free_pages());
+
+    // class mapping: exact below TLSF_SL_COUNT, rounded up above it
+    tlsf_mapping(5, &fl, &sl);
+    assert(fl == 0 && sl == 5);
+    tlsf_mapping(TLSF_SL_COUNT * 2 + 1, &fl, &sl);
+    assert(fl == 2 && sl == 0);
+    tlsf_mapping_search(TLSF_SL_COUNT * 2 + 1, &fl, &sl);
+    assert(fl == 2 && sl == 1);
+
+    // the pages around the 5-page extent stay allocated, so the boundary
+    // tags never see the free extents that are hidden below
+    struct Page *guard = alloc_pages(7), *p0, *p1, *p2;
+    assert(guard != NULL);
+    p0 = guard + 1;
+    assert(!PageProperty(p0));
+
+    list_entry_t list_store[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    uint32_t fl_bitmap_store = fl_bitmap, sl_bitmap_store[TLSF_FL_COUNT];
+    size_t nr_free_store = tlsf_nr_free;
+    memcpy(list_store, tlsf_list, sizeof(tlsf_list));
+    memcpy(sl_bitmap_store, sl_bitmap, sizeof(sl_bitmap));
+    tlsf_init();
+    assert(alloc_page() == NULL);
+
+    free_pages(p0 + 2, 3);
+    assert(alloc_pages(4) == NULL);
+    assert(PageProperty(p0 + 2) && p0[2].property == 3);
+    assert((p1 = alloc_pages(3)) != NULL);
+    assert(alloc_page() == NULL);
+    assert(p0 + 2 == p1);
+
+    p2 = p0 + 1;
+    free_page(p0);
+    free_pages(p1, 3);
+    assert(PageProperty(p0) && p0->property == 1);
+    assert(PageProperty(p1) && p1->property == 3);
+
+    assert((p0 = alloc_page()) == p2 - 1);
+    free_page(p0);
+    assert((p0 = alloc_pages(2)) == p2 + 1);
+
+    free_pages(p0, 2);
+    free_page(p2);
+    assert(fl_bitmap == 1 && sl_bitmap[0] == (1 << 5));
+
+    assert((p0 = alloc_pages(5)) == guard + 1);
+    assert(alloc_page() == NULL);
+
+    assert(tlsf_nr_free == 0 && fl_bitmap == 0);
+    tlsf_nr_free = nr_free_store;
+    fl_bitmap = fl_bitmap_store;
+    memcpy(tlsf_list, list_store, sizeof(tlsf_list));
+    memcpy(sl_bitmap, sl_bitmap_store, sizeof(sl_bitmap));
+    free_pages(guard, 7);
+
+    for (fl = 0; fl < TLSF_FL_COUNT; fl ++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl ++) {
+            list_entry_t *list = &tlsf_list[fl][sl], *le = list;
+            while ((le = list_next(le)) != list) {
+                count --, total -= le2page(le, page_link)->property;
+            }
+        }
+    }
+    assert(count == 0);
+    assert(total == 0);
+}
+
+const struct pmm_manager tlsf_pmm_manager = {
+    .name = "tlsf_pmm_manager",
+    .init = tlsf_init,
+    .init_memmap = tlsf_init_memmap,
+    .alloc_pages = tlsf_alloc_pages,
+    .free_pages = tlsf_free_pages,
+    .nr_free_pages = tlsf_nr_free_pages,
+    .check = tlsf_check,
+};
+
@@ -0,0 +1,13 @@
+#ifndef __KERN_MM_TLSF_PMM_H__
+#define  __KERN_MM_TLSF_PMM_H__
+
+#include <pmm.h>
+
+#define TLSF_SL_SHIFT               3                           // log2 of # of second level lists
+#define TLSF_SL_COUNT               (1 << TLSF_SL_SHIFT)        // # of second level lists per first level
+#define TLSF_FL_COUNT               20                          // # of first level classes, enough for 2^22 pages
+
+extern const struct pmm_manager tlsf_pmm_manager;
+
+#endif /* ! __KERN_MM_TLSF_PMM_H__ */
+
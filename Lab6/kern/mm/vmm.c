@@ -5,39 +5,68 @@
 #include <stdio.h>
 #include <error.h>
 #include <pmm.h>
+#include <buddy_pmm.h>
 #include <x86.h>
 #include <swap.h>
+#include <rmap.h>
 #include <kmalloc.h>
+#include <proc.h>
 
 /* 
   vmm design include two parts: mm_struct (mm) & vma_struct (vma)
   mm is the memory manager for the set of continuous virtual memory  
   area which have the same PDT. vma is a continuous virtual memory area.
   There a linear link list for vma & a redblack link list for vma in mm.
+  The list keeps the vmas in order for walking them, the redblack tree is
+  only built once the mm has RB_MIN_MAP_COUNT vmas, and then used to find
+  a vma in O(log n) instead of walking the list. Every tree node also keeps
+  vm_gap_max, the largest hole below a vma in its subtree, so that
+  get_unmapped_area finds a hole of len bytes in O(log n) too.
 ---------------
   mm related functions:
    golbal functions
      struct mm_struct * mm_create(void)
      void mm_destroy(struct mm_struct *mm)
      int do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr)
+     int mm_map(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags, ...)
+     int mm_unmap(struct mm_struct *mm, uintptr_t addr, size_t len)
+     int mm_brk(struct mm_struct *mm, uintptr_t addr, size_t len)
+     int mm_protect(struct mm_struct *mm, uintptr_t addr, size_t len, bool write)
+     int mm_populate(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+     int do_mmap(uintptr_t *addr_store, size_t len, uint32_t mmap_flags)
+     int do_munmap(uintptr_t addr, size_t len)
+     int do_mprotect(uintptr_t addr, size_t len, uint32_t mmap_flags)
+     uintptr_t get_unmapped_area(struct mm_struct *mm, size_t len)
 --------------
   vma related functions:
    global functions
      struct vma_struct * vma_create (uintptr_t vm_start, uintptr_t vm_end,...)
-     void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
+     struct vma_struct * insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
      struct vma_struct * find_vma(struct mm_struct *mm, uintptr_t addr)
    local functions
      inline void check_vma_overlap(struct vma_struct *prev, struct vma_struct *next)
+     inline struct vma_struct * find_vma_rb(rb_tree *tree, uintptr_t addr)
+     inline struct vma_struct * find_vma_prev_rb(rb_tree *tree, uintptr_t addr)
+     struct vma_struct * find_vma_intersection(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+     void remove_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
+     void vma_resize(struct vma_struct *vma, uintptr_t start, uintptr_t end)
+     inline int vma_compare(rb_node *node1, rb_node *node2)
+     void vma_gap_augment(rb_tree *tree, rb_node *node)
+     struct Page * vma_alloc_page(pde_t *pgdir, struct vma_struct *vma, uintptr_t la, uint32_t perm)
 ---------------
    check correctness functions
      void check_vmm(void);
      void check_vma_struct(void);
+     void check_unmapped_area(void);
      void check_pgfault(void);
 */
 
 static void check_vmm(void);
 static void check_vma_struct(void);
+static void check_unmapped_area(void);
 static void check_pgfault(void);
+static void check_huge_page(void);
+static void check_mm_protect(void);
 
 // mm_create -  alloc a mm_struct & initialize it.
 struct mm_struct *
@@ -46,6 +75,7 @@ mm_create(void) {
 
     if (mm != NULL) {
         list_init(&(mm->mmap_list));
+        mm->mmap_tree = NULL;
         mm->mmap_cache = NULL;
         mm->pgdir = NULL;
         mm->map_count = 0;
@@ -54,7 +84,13 @@ mm_create(void) {
         else mm->sm_priv = NULL;
         
         set_mm_count(mm, 0);
+        mm->nr_pgfault = mm->nr_fault_around = mm->nr_huge_fault = 0;
+        mm->nr_vma_merge = 0;
         lock_init(&(mm->mm_lock));
+        if (anon_vma_create(mm) != 0) {
+            kfree(mm);
+            mm = NULL;
+        }
     }    
     return mm;
 }
@@ -68,11 +104,32 @@ vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t vm_flags) {
         vma->vm_start = vm_start;
         vma->vm_end = vm_end;
         vma->vm_flags = vm_flags;
+        vma->vm_image = NULL;
+        vma->vm_image_start = vma->vm_image_end = 0;
     }
     return vma;
 }
 
 
+// find_vma_rb - find a vma (vma->vm_start <= addr < vma_vm_end) in the redblack tree
+static inline struct vma_struct *
+find_vma_rb(rb_tree *tree, uintptr_t addr) {
+    rb_node *node = rb_node_root(tree);
+    while (node != NULL) {
+        struct vma_struct *vma = rbn2vma(node, rb_link);
+        if (addr < vma->vm_start) {
+            node = rb_node_left(tree, node);
+        }
+        else if (addr >= vma->vm_end) {
+            node = rb_node_right(tree, node);
+        }
+        else {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
 // find_vma - find a vma  (vma->vm_start <= addr <= vma_vm_end)
 struct vma_struct *
 find_vma(struct mm_struct *mm, uintptr_t addr) {
@@ -80,6 +137,10 @@ find_vma(struct mm_struct *mm, uintptr_t addr) {
     if (mm != NULL) {
         vma = mm->mmap_cache;
         if (!(vma != NULL && vma->vm_start <= addr && vma->vm_end > addr)) {
+            if (mm->mmap_tree != NULL) {
+                vma = find_vma_rb(mm->mmap_tree, addr);
+            }
+            else {
                 bool found = 0;
                 list_entry_t *list = &(mm->mmap_list), *le = list;
                 while ((le = list_next(le)) != list) {
@@ -92,6 +153,7 @@ find_vma(struct mm_struct *mm, uintptr_t addr) {
                 if (!found) {
                     vma = NULL;
                 }
+            }
         }
         if (vma != NULL) {
             mm->mmap_cache = vma;
@@ -110,13 +172,137 @@ check_vma_overlap(struct vma_struct *prev, struct vma_struct *next) {
 }
 
 
-// insert_vma_struct -insert vma in mm's list link
-void
+// vma_compare - compare vma1->vm_start < vma2->vm_start ?
+static inline int
+vma_compare(rb_node *node1, rb_node *node2) {
+    struct vma_struct *vma1 = rbn2vma(node1, rb_link);
+    struct vma_struct *vma2 = rbn2vma(node2, rb_link);
+    uintptr_t start1 = vma1->vm_start, start2 = vma2->vm_start;
+    return (start1 < start2) ? -1 : (start1 > start2) ? 1 : 0;
+}
+
+// vma_gap - the free space between the vma before vma (or address 0) and vma
+static inline uintptr_t
+vma_gap(struct vma_struct *vma) {
+    list_entry_t *le = list_prev(&(vma->list_link));
+    uintptr_t prev_end = (le != &(vma->vm_mm->mmap_list)) ? le2vma(le, list_link)->vm_end : 0;
+    return (vma->vm_start > prev_end) ? vma->vm_start - prev_end : 0;
+}
+
+// vma_gap_augment - vm_gap_max of a vma is the largest vma_gap in its subtree
+static void
+vma_gap_augment(rb_tree *tree, rb_node *node) {
+    struct vma_struct *vma = rbn2vma(node, rb_link);
+    uintptr_t gap_max = vma_gap(vma);
+    rb_node *child;
+    if ((child = rb_node_left(tree, node)) != NULL && rbn2vma(child, rb_link)->vm_gap_max > gap_max) {
+        gap_max = rbn2vma(child, rb_link)->vm_gap_max;
+    }
+    if ((child = rb_node_right(tree, node)) != NULL && rbn2vma(child, rb_link)->vm_gap_max > gap_max) {
+        gap_max = rbn2vma(child, rb_link)->vm_gap_max;
+    }
+    vma->vm_gap_max = gap_max;
+}
+
+// vma_gap_update - vma_gap of vma has changed, update vm_gap_max up to the root
+static inline void
+vma_gap_update(struct mm_struct *mm, struct vma_struct *vma) {
+    if (mm->mmap_tree != NULL && vma != NULL) {
+        rb_augment(mm->mmap_tree, &(vma->rb_link));
+    }
+}
+
+// vma_next - the vma after vma in mm, or NULL
+static inline struct vma_struct *
+vma_next(struct mm_struct *mm, struct vma_struct *vma) {
+    list_entry_t *le = list_next(&(vma->list_link));
+    return (le != &(mm->mmap_list)) ? le2vma(le, list_link) : NULL;
+}
+
+// find_vma_prev_rb - find the last vma with vma->vm_start <= addr in the redblack tree
+static inline struct vma_struct *
+find_vma_prev_rb(rb_tree *tree, uintptr_t addr) {
+    rb_node *node = rb_node_root(tree);
+    struct vma_struct *vma = NULL;
+    while (node != NULL) {
+        struct vma_struct *tmp = rbn2vma(node, rb_link);
+        if (tmp->vm_start <= addr) {
+            vma = tmp;
+            node = rb_node_right(tree, node);
+        }
+        else {
+            node = rb_node_left(tree, node);
+        }
+    }
+    return vma;
+}
+
+// find_vma_intersection - find the first vma which overlaps [start, end), or NULL
+static struct vma_struct *
+find_vma_intersection(struct mm_struct *mm, uintptr_t start, uintptr_t end) {
+    struct vma_struct *vma = NULL;
+    if (mm->mmap_tree != NULL) {
+        rb_node *node = rb_node_root(mm->mmap_tree);
+        while (node != NULL) {
+            struct vma_struct *tmp = rbn2vma(node, rb_link);
+            if (tmp->vm_end > start) {
+                vma = tmp;
+                if (tmp->vm_start <= start) {
+                    break;
+                }
+                node = rb_node_left(mm->mmap_tree, node);
+            }
+            else {
+                node = rb_node_right(mm->mmap_tree, node);
+            }
+        }
+    }
+    else {
+        list_entry_t *list = &(mm->mmap_list), *le = list;
+        while ((le = list_next(le)) != list) {
+            if (le2vma(le, list_link)->vm_end > start) {
+                vma = le2vma(le, list_link);
+                break;
+            }
+        }
+    }
+    return (vma != NULL && vma->vm_start < end) ? vma : NULL;
+}
+
+static void remove_vma_struct(struct mm_struct *mm, struct vma_struct *vma);
+static void vma_resize(struct vma_struct *vma, uintptr_t start, uintptr_t end);
+
+// vma_mergeable - prev ends where next starts, and one vma can stand for both
+static inline bool
+vma_mergeable(struct vma_struct *prev, struct vma_struct *next) {
+    return prev->vm_end == next->vm_start && prev->vm_flags == next->vm_flags
+        && prev->vm_image == NULL && next->vm_image == NULL;
+}
+
+// vma_merges - insert_vma_struct would merge vma into a neighbour, so it doesn't
+//            - count against MAX_MAP_COUNT
+static bool
+vma_merges(struct mm_struct *mm, struct vma_struct *vma) {
+    struct vma_struct *prev = find_vma(mm, vma->vm_start - 1), *next = find_vma(mm, vma->vm_end);
+    return (prev != NULL && vma_mergeable(prev, vma)) || (next != NULL && vma_mergeable(vma, next));
+}
+
+// insert_vma_struct -insert vma in mm's list link, and in the redblack tree if mm has one
+//                   - an anonymous vma next to one or two vmas like it is merged into them
+//                   - and freed, the vma that covers its range now is returned.
+struct vma_struct *
 insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma) {
     assert(vma->vm_start < vma->vm_end);
     list_entry_t *list = &(mm->mmap_list);
     list_entry_t *le_prev = list, *le_next;
 
+    if (mm->mmap_tree != NULL) {
+        struct vma_struct *mmap_prev = find_vma_prev_rb(mm->mmap_tree, vma->vm_start);
+        if (mmap_prev != NULL) {
+            le_prev = &(mmap_prev->list_link);
+        }
+    }
+    else {
         list_entry_t *le = list;
         while ((le = list_next(le)) != list) {
             struct vma_struct *mmap_prev = le2vma(le, list_link);
@@ -125,6 +311,7 @@ insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma) {
             }
             le_prev = le;
         }
+    }
 
     le_next = list_next(le_prev);
 
@@ -136,10 +323,76 @@ insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma) {
         check_vma_overlap(vma, le2vma(le_next, list_link));
     }
 
+    struct vma_struct *prev = (le_prev != list) ? le2vma(le_prev, list_link) : NULL;
+    struct vma_struct *next = (le_next != list) ? le2vma(le_next, list_link) : NULL;
+    if (prev != NULL && vma_mergeable(prev, vma)) {
+        uintptr_t end = vma->vm_end;
+        if (next != NULL && vma_mergeable(vma, next)) {
+            end = next->vm_end;
+            remove_vma_struct(mm, next);
+            kfree(next);
+            mm->nr_vma_merge ++;
+        }
+        vma_resize(prev, prev->vm_start, end);
+        kfree(vma);
+        mm->nr_vma_merge ++;
+        return prev;
+    }
+    if (next != NULL && vma_mergeable(vma, next)) {
+        // no vma lies between, so next keeps its place in the tree
+        vma_resize(next, vma->vm_start, next->vm_end);
+        kfree(vma);
+        mm->nr_vma_merge ++;
+        return next;
+    }
+
     vma->vm_mm = mm;
     list_add_after(le_prev, &(vma->list_link));
 
     mm->map_count ++;
+    if (mm->mmap_tree != NULL) {
+        // the gaps come from the list, so the tree is updated after it
+        rb_insert(mm->mmap_tree, &(vma->rb_link));
+        vma_gap_update(mm, vma_next(mm, vma));
+    }
+    else if (mm->map_count >= RB_MIN_MAP_COUNT) {
+        /* try to build red-black tree now, but may fail. */
+        mm->mmap_tree = rb_tree_create_augmented(vma_compare, vma_gap_augment);
+        if (mm->mmap_tree != NULL) {
+            list_entry_t *le = list;
+            while ((le = list_next(le)) != list) {
+                rb_insert(mm->mmap_tree, &(le2vma(le, list_link)->rb_link));
+            }
+        }
+    }
+    return vma;
+}
+
+// remove_vma_struct - take vma out of mm's list link and redblack tree, but don't free it
+static void
+remove_vma_struct(struct mm_struct *mm, struct vma_struct *vma) {
+    assert(mm == vma->vm_mm);
+    struct vma_struct *next = vma_next(mm, vma);
+    if (mm->mmap_tree != NULL) {
+        rb_delete(mm->mmap_tree, &(vma->rb_link));
+    }
+    list_del(&(vma->list_link));
+    vma_gap_update(mm, next);
+    if (mm->mmap_cache == vma) {
+        mm->mmap_cache = NULL;
+    }
+    mm->map_count --;
+}
+
+// vma_resize - set the range of vma to [start, end), it must not reach another vma
+static void
+vma_resize(struct vma_struct *vma, uintptr_t start, uintptr_t end) {
+    assert(start % PGSIZE == 0 && end % PGSIZE == 0 && start < end);
+    struct mm_struct *mm = vma->vm_mm;
+    vma->vm_start = start;
+    vma->vm_end = end;
+    vma_gap_update(mm, vma);
+    vma_gap_update(mm, vma_next(mm, vma));
 }
 
 // mm_destroy - free mm and mm internal fields
@@ -152,6 +405,10 @@ mm_destroy(struct mm_struct *mm) {
         list_del(le);
         kfree(le2vma(le, list_link));  //kfree vma        
     }
+    if (mm->mmap_tree != NULL) {
+        rb_tree_destroy(mm->mmap_tree);
+    }
+    anon_vma_exit(mm);
     kfree(mm); //kfree mm
     mm=NULL;
 }
@@ -169,7 +426,7 @@ mm_map(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags,
     int ret = -E_INVAL;
 
     struct vma_struct *vma;
-    if ((vma = find_vma(mm, start)) != NULL && end > vma->vm_start) {
+    if (find_vma_intersection(mm, start, end) != NULL) {
         goto out;
     }
     ret = -E_NO_MEM;
@@ -177,7 +434,11 @@ mm_map(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags,
     if ((vma = vma_create(start, end, vm_flags)) == NULL) {
         goto out;
     }
-    insert_vma_struct(mm, vma);
+    if (mm->map_count >= MAX_MAP_COUNT && !vma_merges(mm, vma)) {
+        kfree(vma);
+        goto out;
+    }
+    vma = insert_vma_struct(mm, vma);
     if (vma_store != NULL) {
         *vma_store = vma;
     }
@@ -187,9 +448,273 @@ out:
     return ret;
 }
 
+// mm_unmap - remove [addr, addr + len) from mm: vmas inside it are freed, vmas
+//          - across its ends are cut, and a vma around it is split in two.
+//          - the pages are released with one TLB flush at the end.
+int
+mm_unmap(struct mm_struct *mm, uintptr_t addr, size_t len) {
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = ROUNDUP(addr + len, PGSIZE);
+    if (!USER_ACCESS(start, end)) {
+        return -E_INVAL;
+    }
+
+    assert(mm != NULL);
+
+    struct vma_struct *vma, *next;
+    if ((vma = find_vma_intersection(mm, start, end)) == NULL) {
+        return 0;
+    }
+    int ret;
+    if ((ret = unshare_range(mm->pgdir, start, end)) != 0) {
+        return ret;
+    }
+    if (vma->vm_start < start && end < vma->vm_end) {
+        struct vma_struct *nvma;
+        if (mm->map_count >= MAX_MAP_COUNT || (nvma = vma_create(vma->vm_start, start, vma->vm_flags)) == NULL) {
+            return -E_NO_MEM;
+        }
+        nvma->vm_image = vma->vm_image;
+        nvma->vm_image_start = vma->vm_image_start, nvma->vm_image_end = vma->vm_image_end;
+        vma_resize(vma, end, vma->vm_end);
+        insert_vma_struct(mm, nvma);
+        return unmap_range(mm->pgdir, start, end);
+    }
+    for (; vma != NULL && vma->vm_start < end; vma = next) {
+        next = vma_next(mm, vma);
+        if (vma->vm_start < start) {
+            vma_resize(vma, vma->vm_start, start);
+        }
+        else if (end < vma->vm_end) {
+            vma_resize(vma, end, vma->vm_end);
+        }
+        else {
+            remove_vma_struct(mm, vma);
+            kfree(vma);
+        }
+    }
+    // the pages go in one pass over [start, end), so a 4MB page that several
+    // vmas share is unmapped whole instead of being split at their boundary.
+    // the holes between the vmas have nothing mapped.
+    return unmap_range(mm->pgdir, start, end);
+}
+
+// mm_brk - make [addr, addr + len) a read/write heap area of mm. whatever was
+//        - mapped there is unmapped first, and a heap vma ending at addr grows
+//        - instead of a new vma being added.
+int
+mm_brk(struct mm_struct *mm, uintptr_t addr, size_t len) {
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = ROUNDUP(addr + len, PGSIZE);
+    if (!USER_ACCESS(start, end)) {
+        return -E_INVAL;
+    }
+
+    int ret;
+    if ((ret = mm_unmap(mm, start, end - start)) != 0) {
+        return ret;
+    }
+    // the heap vma below grows, insert_vma_struct merges the new range into it
+    struct vma_struct *vma;
+    if ((vma = vma_create(start, end, VM_READ | VM_WRITE)) == NULL) {
+        return -E_NO_MEM;
+    }
+    if (mm->map_count >= MAX_MAP_COUNT && !vma_merges(mm, vma)) {
+        kfree(vma);
+        return -E_NO_MEM;
+    }
+    insert_vma_struct(mm, vma);
+    return 0;
+}
+
+// vma_set_flags - give [start, end) of vma the flags vm_flags. the parts of vma around
+//               - it keep the old ones. vma is taken out and all parts are put back with
+//               - insert_vma_struct, so they merge with the vmas next to them.
+static int
+vma_set_flags(struct mm_struct *mm, struct vma_struct *vma, uintptr_t start, uintptr_t end, uint32_t vm_flags) {
+    struct vma_struct *low = NULL, *high = NULL;
+    if (vma->vm_start < start && (low = vma_create(vma->vm_start, start, vma->vm_flags)) == NULL) {
+        return -E_NO_MEM;
+    }
+    if (end < vma->vm_end && (high = vma_create(end, vma->vm_end, vma->vm_flags)) == NULL) {
+        if (low != NULL) {
+            kfree(low);
+        }
+        return -E_NO_MEM;
+    }
+    remove_vma_struct(mm, vma);
+    vma->vm_start = start, vma->vm_end = end, vma->vm_flags = vm_flags;
+    if (low != NULL) {
+        low->vm_image = vma->vm_image;
+        low->vm_image_start = vma->vm_image_start, low->vm_image_end = vma->vm_image_end;
+        insert_vma_struct(mm, low);
+    }
+    if (high != NULL) {
+        high->vm_image = vma->vm_image;
+        high->vm_image_start = vma->vm_image_start, high->vm_image_end = vma->vm_image_end;
+        insert_vma_struct(mm, high);
+    }
+    insert_vma_struct(mm, vma);
+    return 0;
+}
+
+// protect_map_part - part follows last in the vmas mm_protect leaves: one vma less if
+//                  - part merges into last, which vma_set_flags only does when one of
+//                  - them is put back (fresh). last grows over part then, a last
+//                  - with vm_end 0 is none yet.
+static void
+protect_map_part(struct vma_struct *last, bool *last_fresh, struct vma_struct *part, bool fresh, int *count) {
+    if (last->vm_end != 0 && (fresh || *last_fresh) && vma_mergeable(last, part)) {
+        last->vm_end = part->vm_end;
+        *last_fresh = 1, (*count) --;
+        return;
+    }
+    *last = *part, *last_fresh = fresh;
+}
+
+// protect_map_count - the map_count mm will have after mm_protect(start, end, write),
+//                   - found without changing anything: the first and last vma may
+//                   - leave a part outside the range, and the parts merge as in
+//                   - vma_set_flags. [start, end) must be mapped.
+static int
+protect_map_count(struct mm_struct *mm, uintptr_t start, uintptr_t end, bool write) {
+    int count = mm->map_count;
+    struct vma_struct *vma = find_vma(mm, start), *prev, last, part;
+    bool last_fresh = 0;
+    last.vm_end = 0;
+    if ((prev = find_vma(mm, vma->vm_start - 1)) != NULL) {
+        protect_map_part(&last, &last_fresh, prev, 0, &count);
+    }
+    for (; vma != NULL && vma->vm_start < end; vma = vma_next(mm, vma)) {
+        uint32_t vm_flags = (write) ? (vma->vm_flags | VM_WRITE) : (vma->vm_flags & ~VM_WRITE);
+        if (vm_flags == vma->vm_flags) {
+            protect_map_part(&last, &last_fresh, vma, 0, &count);
+            continue;
+        }
+        part = *vma, count --;
+        if (vma->vm_start < start) {
+            part.vm_end = start, count ++;
+            protect_map_part(&last, &last_fresh, &part, 1, &count);
+        }
+        part.vm_start = (vma->vm_start < start) ? start : vma->vm_start;
+        part.vm_end = (vma->vm_end < end) ? vma->vm_end : end;
+        part.vm_flags = vm_flags, count ++;
+        protect_map_part(&last, &last_fresh, &part, 1, &count);
+        if (end < vma->vm_end) {
+            part.vm_start = end, part.vm_end = vma->vm_end;
+            part.vm_flags = vma->vm_flags, count ++;
+            protect_map_part(&last, &last_fresh, &part, 1, &count);
+        }
+    }
+    if (vma != NULL) {
+        protect_map_part(&last, &last_fresh, vma, 0, &count);
+    }
+    return count;
+}
+
+// mm_protect - make [addr, addr + len) of mm writable or read only, all of it must be
+//            - mapped. write protection goes to the PTEs at once; a page made writable
+//            - faults on its first write and do_pgfault sets PTE_W (or copies it).
+//            - x86 has no unreadable present pages, so only VM_WRITE can change.
+int
+mm_protect(struct mm_struct *mm, uintptr_t addr, size_t len, bool write) {
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = ROUNDUP(addr + len, PGSIZE);
+    if (!USER_ACCESS(start, end)) {
+        return -E_INVAL;
+    }
+
+    assert(mm != NULL);
+
+    struct vma_struct *vma;
+    uintptr_t la;
+    for (la = start; la < end; la = vma->vm_end) {
+        if ((vma = find_vma(mm, la)) == NULL) {
+            return -E_INVAL;
+        }
+    }
+    // the vmas added are counted over the whole range first, so that nothing
+    // changes when MAX_MAP_COUNT would be passed
+    if (protect_map_count(mm, start, end, write) > MAX_MAP_COUNT) {
+        return -E_NO_MEM;
+    }
+    int ret;
+    // a 4MB page cut by the range is split, in both directions: huge_reuse
+    // would make all of it writable, and mm_unmap can't drop half of it
+    if ((start % PTSIZE != 0 && (ret = huge_split(mm->pgdir, start)) != 0)
+        || (end % PTSIZE != 0 && (ret = huge_split(mm->pgdir, end)) != 0)) {
+        return ret;
+    }
+    if (!write && (ret = protect_range(mm->pgdir, start, end)) != 0) {
+        return ret;
+    }
+    for (la = start; la < end; ) {
+        vma = find_vma(mm, la);
+        uint32_t vm_flags = (write) ? (vma->vm_flags | VM_WRITE) : (vma->vm_flags & ~VM_WRITE);
+        uintptr_t vm_end = (vma->vm_end < end) ? vma->vm_end : end;
+        if (vm_flags != vma->vm_flags && (ret = vma_set_flags(mm, vma, la, vm_end, vm_flags)) != 0) {
+            return ret;
+        }
+        la = vm_end;
+    }
+    return 0;
+}
+
+// find_gap_rb - find the highest vma with a hole of at least len below it in the
+//             - redblack tree, going down only into subtrees whose vm_gap_max fits
+static struct vma_struct *
+find_gap_rb(rb_tree *tree, size_t len) {
+    rb_node *node = rb_node_root(tree), *right;
+    if (node == NULL || rbn2vma(node, rb_link)->vm_gap_max < len) {
+        return NULL;
+    }
+    while (1) {
+        if ((right = rb_node_right(tree, node)) != NULL && rbn2vma(right, rb_link)->vm_gap_max >= len) {
+            node = right;
+            continue;
+        }
+        struct vma_struct *vma = rbn2vma(node, rb_link);
+        if (vma_gap(vma) >= len) {
+            return vma;
+        }
+        node = rb_node_left(tree, node);
+        assert(node != NULL);
+    }
+}
+
+// get_unmapped_area - find the highest free range of len bytes in [USERBASE, USERTOP)
+//                   - of mm, return its start, or 0 if there is none.
+uintptr_t
+get_unmapped_area(struct mm_struct *mm, size_t len) {
+    len = ROUNDUP(len, PGSIZE);
+    if (len == 0 || len > USERTOP - USERBASE) {
+        return 0;
+    }
+    list_entry_t *list = &(mm->mmap_list), *le = list_prev(list);
+    uintptr_t start = USERTOP - len;
+    if (le != list && le2vma(le, list_link)->vm_end > start) {
+        struct vma_struct *vma = NULL;
+        if (mm->mmap_tree != NULL) {
+            vma = find_gap_rb(mm->mmap_tree, len);
+        }
+        else {
+            for (; le != list; le = list_prev(le)) {
+                if (vma_gap(le2vma(le, list_link)) >= len) {
+                    vma = le2vma(le, list_link);
+                    break;
+                }
+            }
+        }
+        if (vma == NULL) {
+            return 0;
+        }
+        start = vma->vm_start - len;
+    }
+    return (start >= USERBASE) ? start : 0;
+}
+
 int
 dup_mmap(struct mm_struct *to, struct mm_struct *from) {
     assert(to != NULL && from != NULL);
+    // the pages shared below are found through the family of from from now on
+    anon_vma_fork(to, from);
     list_entry_t *list = &(from->mmap_list), *le = list;
     while ((le = list_prev(le)) != list) {
         struct vma_struct *vma, *nvma;
@@ -198,13 +723,12 @@ dup_mmap(struct mm_struct *to, struct mm_struct *from) {
         if (nvma == NULL) {
             return -E_NO_MEM;
         }
+        nvma->vm_image = vma->vm_image;
+        nvma->vm_image_start = vma->vm_image_start, nvma->vm_image_end = vma->vm_image_end;
 
         insert_vma_struct(to, nvma);
 
-        bool share = 0;
-        if (copy_range(to->pgdir, from->pgdir, vma->vm_start, vma->vm_end, share) != 0) {
-            return -E_NO_MEM;
-        }
+        share_range(to->pgdir, from->pgdir, vma->vm_start, vma->vm_end);
     }
     return 0;
 }
@@ -212,40 +736,94 @@ dup_mmap(struct mm_struct *to, struct mm_struct *from) {
 void
 exit_mmap(struct mm_struct *mm) {
     assert(mm != NULL && mm_count(mm) == 0);
-    pde_t *pgdir = mm->pgdir;
-    list_entry_t *list = &(mm->mmap_list), *le = list;
-    while ((le = list_next(le)) != list) {
-        struct vma_struct *vma = le2vma(le, list_link);
-        unmap_range(pgdir, vma->vm_start, vma->vm_end);
-    }
-    while ((le = list_next(le)) != list) {
-        struct vma_struct *vma = le2vma(le, list_link);
-        exit_range(pgdir, vma->vm_start, vma->vm_end);
+    // one pass over the page tables unmaps all vmas and frees the page tables,
+    // the ones still shared with other processes are just dropped
+    exit_range(mm->pgdir, USERBASE, USERTOP);
+}
+
+/* The user copies below do not look up the vmas of the buffer first. They
+ * just copy, and a fault on the user address is handled by do_pgfault as if
+ * the process had touched it. If do_pgfault fails, trap_dispatch finds the
+ * faulting instruction in the exception table and resumes at its fixup,
+ * which ends the copy early. Only the bounds of the user part of the address
+ * space are checked up front, since a kernel address would not fault.
+ */
+
+// copy_user_ex - copy len bytes, return how many were left when a fault stopped the copy
+static size_t
+copy_user_ex(void *dst, const void *src, size_t len) {
+    int d0, d1;
+    asm volatile (
+        "1: rep movsb;"
+        "2:;"
+        ".section __ex_table, \"a\";"
+        ".align 4;"
+        ".long 1b, 2b;"
+        ".previous;"
+        : "+c" (len), "=&D" (d0), "=&S" (d1)
+        : "1" (dst), "2" (src)
+        : "memory");
+    return len;
+}
+
+extern const struct exception_table_entry __start___ex_table[];
+extern const struct exception_table_entry __stop___ex_table[];
+
+// search_exception_table - the fixup address of a faulting kernel instruction, 0 if it has none
+uintptr_t
+search_exception_table(uintptr_t eip) {
+    const struct exception_table_entry *e = __start___ex_table;
+    for (; e < __stop___ex_table; e ++) {
+        if (e->insn == eip) {
+            return e->fixup;
+        }
     }
+    return 0;
 }
 
 bool
 copy_from_user(struct mm_struct *mm, void *dst, const void *src, size_t len, bool writable) {
-    if (!user_mem_check(mm, (uintptr_t)src, len, writable)) {
+    if (mm == NULL || writable) {
+        // a read cannot tell whether the buffer is writable
+        if (!user_mem_check(mm, (uintptr_t)src, len, writable)) {
+            return 0;
+        }
+        memcpy(dst, src, len);
+        return 1;
+    }
+    if (!USER_ACCESS((uintptr_t)src, (uintptr_t)src + len)) {
         return 0;
     }
-    memcpy(dst, src, len);
-    return 1;
+    return copy_user_ex(dst, src, len) == 0;
 }
 
 bool
 copy_to_user(struct mm_struct *mm, void *dst, const void *src, size_t len) {
-    if (!user_mem_check(mm, (uintptr_t)dst, len, 1)) {
+    if (mm == NULL) {
+        if (!user_mem_check(mm, (uintptr_t)dst, len, 1)) {
+            return 0;
+        }
+        memcpy(dst, src, len);
+        return 1;
+    }
+    if (!USER_ACCESS((uintptr_t)dst, (uintptr_t)dst + len)) {
         return 0;
     }
-    memcpy(dst, src, len);
-    return 1;
+    return copy_user_ex(dst, src, len) == 0;
 }
 
+// the read only page that all reads of untouched anonymous memory see, see vma_alloc_page
+struct Page *zero_page;
+
 // vmm_init - initialize virtual memory management
-//          - now just call check_vmm to check correctness of vmm
+//          - set up the zero page and call check_vmm to check correctness of vmm
 void
 vmm_init(void) {
+    if ((zero_page = alloc_zeroed_page()) == NULL) {
+        panic("vmm_init: no memory for zero_page.\n");
+    }
+    // reserved: never freed or swapped out, and copied on the first write
+    SetPageReserved(zero_page);
     check_vmm();
 }
 
@@ -254,8 +832,12 @@ static void
 check_vmm(void) {
     size_t nr_free_pages_store = nr_free_pages();
     
+    check_rb_tree();
     check_vma_struct();
+    check_unmapped_area();
     check_pgfault();
+    check_huge_page();
+    check_mm_protect();
 
     cprintf("check_vmm() succeeded.\n");
 }
@@ -282,6 +864,9 @@ check_vma_struct(void) {
         insert_vma_struct(mm, vma);
     }
 
+    // more than RB_MIN_MAP_COUNT vmas, find_vma below goes through the tree
+    assert(mm->map_count == step2 && mm->mmap_tree != NULL);
+
     list_entry_t *le = list_next(&(mm->mmap_list));
 
     for (i = 1; i <= step2; i ++) {
@@ -320,12 +905,121 @@ check_vma_struct(void) {
     cprintf("check_vma_struct() succeeded!\n");
 }
 
+// check_gap_max - check vm_gap_max of every vma in the subtree of node, return the largest
+static uintptr_t
+check_gap_max(rb_tree *tree, rb_node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    struct vma_struct *vma = rbn2vma(node, rb_link);
+    uintptr_t gap_max = vma_gap(vma), left, right;
+    left = check_gap_max(tree, rb_node_left(tree, node));
+    right = check_gap_max(tree, rb_node_right(tree, node));
+    if (left > gap_max) {
+        gap_max = left;
+    }
+    if (right > gap_max) {
+        gap_max = right;
+    }
+    assert(vma->vm_gap_max == gap_max);
+    return gap_max;
+}
+
+static void
+check_unmapped_area(void) {
+    struct mm_struct *mm = mm_create();
+    assert(mm != NULL);
+    // nothing is mapped in the user part of boot_pgdir, so there are no pages to unmap
+    mm->pgdir = boot_pgdir;
+
+    // n heap vmas of 2 pages, the hole below the ith one is n + 1 - i pages,
+    // and a stack vma right after them up to USERTOP
+    const int n = RB_MIN_MAP_COUNT * 2;
+    static uintptr_t starts[RB_MIN_MAP_COUNT * 2 + 2];
+    uintptr_t start = USERBASE;
+    int i;
+    for (i = 1; i <= n; i ++) {
+        start += (n + 1 - i) * PGSIZE;
+        starts[i] = start;
+        assert(mm_map(mm, start, 2 * PGSIZE, VM_READ | VM_WRITE, NULL) == 0);
+        start += 2 * PGSIZE;
+    }
+    starts[n + 1] = start;
+    assert(mm_map(mm, start, USERTOP - start, VM_READ | VM_WRITE | VM_STACK, NULL) == 0);
+    assert(mm->mmap_tree != NULL && mm->map_count == n + 1);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+
+    // overlapping an existing vma is refused
+    assert(mm_map(mm, starts[2] - PGSIZE, 4 * PGSIZE, VM_READ, NULL) == -E_INVAL);
+
+    // the highest hole of k pages is the one below the (n + 1 - k)th vma
+    for (i = 1; i <= n; i ++) {
+        assert(get_unmapped_area(mm, i * PGSIZE) == starts[n + 1 - i] - i * PGSIZE);
+    }
+    assert(get_unmapped_area(mm, (n + 1) * PGSIZE) == 0);
+
+    // unmapping a whole vma joins the holes around it
+    int j = n / 2;
+    size_t hole = (n + 1 - j) + 2 + (n - j);
+    assert(mm_unmap(mm, starts[j], 2 * PGSIZE) == 0);
+    assert(mm->map_count == n && find_vma(mm, starts[j]) == NULL);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+    assert(get_unmapped_area(mm, hole * PGSIZE) == starts[j + 1] - hole * PGSIZE);
+
+    // unmapping the head of a vma cuts it, unmapping the middle splits it
+    assert(mm_unmap(mm, starts[j + 1], PGSIZE) == 0);
+    assert(find_vma(mm, starts[j + 1]) == NULL && find_vma(mm, starts[j + 1] + PGSIZE) != NULL);
+    start = starts[n + 1];
+    assert(mm_unmap(mm, start + PGSIZE, PGSIZE) == 0);
+    assert(mm->map_count == n + 1);
+    assert(find_vma(mm, start) != NULL && find_vma(mm, start + PGSIZE) == NULL);
+    assert(find_vma(mm, start + 2 * PGSIZE)->vm_start == start + 2 * PGSIZE);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+    assert(get_unmapped_area(mm, PGSIZE) == start + PGSIZE);
+
+    // brk grows the heap vma below it instead of adding one
+    assert(mm_brk(mm, starts[1] + 2 * PGSIZE, PGSIZE) == 0);
+    assert(mm->map_count == n + 1 && find_vma(mm, starts[1] + 2 * PGSIZE)->vm_start == starts[1]);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+
+    // a vma next to one like it is merged into it, filling a hole joins three
+    assert(mm_map(mm, starts[2] + 2 * PGSIZE, PGSIZE, VM_READ | VM_WRITE, NULL) == 0);
+    assert(mm->map_count == n + 1 && find_vma(mm, starts[2] + 2 * PGSIZE)->vm_start == starts[2]);
+    assert(mm_map(mm, starts[n] - PGSIZE, PGSIZE, VM_READ | VM_WRITE, NULL) == 0);
+    assert(mm->map_count == n && mm->nr_vma_merge == 4);
+    struct vma_struct *vma = find_vma(mm, starts[n] - PGSIZE);
+    assert(vma->vm_start == starts[n - 1] && vma->vm_end == starts[n] + 2 * PGSIZE);
+    assert(mm_map(mm, starts[3] + 2 * PGSIZE, PGSIZE, VM_READ, NULL) == 0);
+    assert(mm->map_count == n + 1);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+
+    // at MAX_MAP_COUNT only a vma that would not merge is refused
+    int map_count_store = mm->map_count;
+    mm->map_count = MAX_MAP_COUNT;
+    assert(mm_map(mm, starts[3] + 5 * PGSIZE, PGSIZE, VM_READ, NULL) == -E_NO_MEM);
+    assert(mm_map(mm, starts[3] + 3 * PGSIZE, PGSIZE, VM_READ, NULL) == 0);
+    assert(mm->map_count == MAX_MAP_COUNT && find_vma(mm, starts[3] + 3 * PGSIZE)->vm_start == starts[3] + 2 * PGSIZE);
+    mm->map_count = map_count_store;
+
+    // one unmap across many vmas
+    assert(mm_unmap(mm, starts[1], start - starts[1]) == 0);
+    assert(mm->map_count == 2 && get_unmapped_area(mm, start - starts[1]) == starts[1]);
+    check_gap_max(mm->mmap_tree, rb_node_root(mm->mmap_tree));
+
+    mm->pgdir = NULL;
+    mm_destroy(mm);
+
+    cprintf("check_unmapped_area() succeeded!\n");
+}
+
 struct mm_struct *check_mm_struct;
 
 // check_pgfault - check correctness of pgfault handler
 static void
 check_pgfault(void) {
     size_t nr_free_pages_store = nr_free_pages();
+    unsigned int fault_around_store = fault_around_pages;
+    fault_around_pages = 0;
 
     check_mm_struct = mm_create();
     assert(check_mm_struct != NULL);
@@ -352,7 +1046,84 @@ check_pgfault(void) {
     }
     assert(sum == 0);
 
-    page_remove(pgdir, ROUNDDOWN(addr, PGSIZE));
+    // copy on write: share the page with a second pgdir, read only in both
+    uintptr_t la = ROUNDDOWN(addr, PGSIZE);
+    pte_t *ptep = get_pte(pgdir, la, 0);
+    struct Page *page = pte2page(*ptep), *cow_page, *npage;
+    assert((cow_page = alloc_zeroed_page()) != NULL);
+    pde_t *cow_pgdir = page2kva(cow_page);
+    assert(page_insert(cow_pgdir, page, la, PTE_U) == 0);
+    *ptep &= ~PTE_W;
+    tlb_invalidate(pgdir, la);
+    assert(page_ref(page) == 2);
+
+    *(char *)(addr + 1) = 100;
+    ptep = get_pte(pgdir, la, 0);
+    npage = pte2page(*ptep);
+    assert(npage != page && (*ptep & PTE_W));
+    assert(page_ref(npage) == 1 && page_ref(page) == 1);
+    assert(*(char *)(addr + 1) == 100 && *(char *)(addr + 2) == 2);
+    assert(*(char *)(page2kva(page) + PGOFF(addr) + 1) == 1);
+
+    // the last read only mapping of a page is made writable in place
+    *ptep &= ~PTE_W;
+    tlb_invalidate(pgdir, la);
+    *(char *)(addr + 1) = 1;
+    ptep = get_pte(pgdir, la, 0);
+    assert(pte2page(*ptep) == npage && (*ptep & PTE_W));
+
+    page_remove(cow_pgdir, la);
+    free_page(pde2page(cow_pgdir[0]));
+
+    // fork shares the page table itself: the first write copies the page
+    // table, then the page the copies still share
+    struct Page *pt = pde2page(pgdir[0]);
+    pgdir[0] &= ~PTE_W;
+    cow_pgdir[0] = pgdir[0];
+    page_ref_inc(pt);
+    tlb_flush(pgdir);
+    assert(pde_shared(pgdir[0]) && page_ref(pt) == 2);
+
+    *(char *)(addr + 1) = 100;
+    assert(!pde_shared(pgdir[0]) && pde2page(cow_pgdir[0]) == pt && page_ref(pt) == 1);
+    ptep = get_pte(pgdir, la, 0);
+    pte_t *cow_ptep = get_pte(cow_pgdir, la, 0);
+    assert(pte2page(*ptep) != npage && pte2page(*cow_ptep) == npage);
+    assert((*ptep & PTE_W) && !(*cow_ptep & PTE_W) && page_ref(npage) == 1);
+    assert(*(char *)(page2kva(npage) + PGOFF(addr) + 1) == 1);
+    *(char *)(addr + 1) = 1;
+
+    page_remove(cow_pgdir, la);
+    free_page(pt);
+    free_page(cow_page);
+
+    for (i = 0; i < 100; i ++) {
+        sum += *(char *)(addr + i) - i;
+    }
+    assert(sum == 0);
+
+    // a read of untouched memory maps the zero page, the first write copies it
+    vma->vm_flags |= VM_READ;
+    assert(*(char *)(9 * PGSIZE) == 0);
+    ptep = get_pte(pgdir, 9 * PGSIZE, 0);
+    assert(pte2page(*ptep) == zero_page && !(*ptep & PTE_W));
+    *(char *)(9 * PGSIZE + 1) = 9;
+    assert(pte2page(*ptep) != zero_page && (*ptep & PTE_W));
+    assert(*(char *)(9 * PGSIZE) == 0 && *(char *)(9 * PGSIZE + 1) == 9);
+    page_remove(pgdir, 9 * PGSIZE);
+    vma->vm_flags &= ~VM_READ;
+
+    // fault around: one fault maps the whole aligned window
+    fault_around_pages = 4;
+    *(char *)(5 * PGSIZE) = 5;
+    assert(mm->nr_fault_around == 3);
+    for (i = 4; i < 8; i ++) {
+        assert(get_page(pgdir, i * PGSIZE, NULL) != NULL);
+        page_remove(pgdir, i * PGSIZE);
+    }
+    fault_around_pages = fault_around_store;
+
+    page_remove(pgdir, la);
     free_page(pa2page(pgdir[0]));
     pgdir[0] = 0;
 
@@ -364,9 +1135,278 @@ check_pgfault(void) {
 
     cprintf("check_pgfault() succeeded!\n");
 }
+
+// check_huge_page - one fault maps a 4MB page, an unmap that cuts it splits it
+static void
+check_huge_page(void) {
+    size_t nr_free_pages_store = nr_free_pages();
+
+    check_mm_struct = mm_create();
+    assert(check_mm_struct != NULL);
+
+    struct mm_struct *mm = check_mm_struct;
+    pde_t *pgdir = mm->pgdir = boot_pgdir;
+    assert(pgdir[1] == 0);
+
+    struct vma_struct *vma = vma_create(PTSIZE, 2 * PTSIZE, VM_READ | VM_WRITE);
+    assert(vma != NULL);
+    insert_vma_struct(mm, vma);
+
+    *(char *)(PTSIZE + PGSIZE + 1) = 1;
+    // without a free aligned 4MB block (or no PSE, or first fit) the fault maps a 4KB page
+    if (mm->nr_huge_fault != 0) {
+        assert(pde_huge(pgdir[1]) && (pgdir[1] & PTE_W));
+        struct Page *page = pa2page(PDE_PS_ADDR(pgdir[1]));
+        assert(get_page(pgdir, PTSIZE + 2 * PGSIZE, NULL) == page + 2);
+        assert(page_ref(page + 2) == 1 && *(char *)(PTSIZE + 3 * PGSIZE) == 0);
+
+        assert(mm_unmap(mm, PTSIZE + 2 * PGSIZE, PGSIZE) == 0);
+        assert(!pde_huge(pgdir[1]) && (pgdir[1] & PTE_P));
+        assert(get_page(pgdir, PTSIZE + 2 * PGSIZE, NULL) == NULL);
+        assert(get_page(pgdir, PTSIZE + 3 * PGSIZE, NULL) == page + 3);
+        assert(*(char *)(PTSIZE + PGSIZE + 1) == 1);
+    }
+    exit_range(pgdir, PTSIZE, 2 * PTSIZE);
+    assert(pgdir[1] == 0);
+
+    // making half of a read only 4MB page writable splits it
+    assert(mm_protect(mm, PTSIZE, PTSIZE, 0) == 0);
+    unsigned int nr_huge_fault = mm->nr_huge_fault;
+    assert(mm_populate(mm, PTSIZE, 2 * PTSIZE) == 0);
+    assert(*(char *)(PTSIZE + PGSIZE) == 0);
+    if (mm->nr_huge_fault != nr_huge_fault) {
+        assert(pde_huge(pgdir[1]) && !(pgdir[1] & PTE_W));
+        assert(mm_protect(mm, PTSIZE, PTSIZE / 2, 1) == 0);
+        assert(!pde_huge(pgdir[1]) && (pgdir[1] & PTE_P));
+        *(char *)(PTSIZE + PGSIZE) = 1;
+        pte_t *ptep = get_pte(pgdir, PTSIZE + PTSIZE / 2, 0);
+        assert(ptep != NULL && (*ptep & PTE_P) && !(*ptep & PTE_W));
+        assert(mm_unmap(mm, PTSIZE, PTSIZE) == 0 && find_vma(mm, PTSIZE) == NULL);
+    }
+    exit_range(pgdir, PTSIZE, 2 * PTSIZE);
+    assert(pgdir[1] == 0);
+
+    mm->pgdir = NULL;
+    mm_destroy(mm);
+    check_mm_struct = NULL;
+
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_huge_page() succeeded!\n");
+}
+
+// check_mm_protect - mm_populate maps a range at once, mm_protect cuts and merges vmas
+static void
+check_mm_protect(void) {
+    size_t nr_free_pages_store = nr_free_pages();
+
+    check_mm_struct = mm_create();
+    assert(check_mm_struct != NULL);
+
+    struct mm_struct *mm = check_mm_struct;
+    pde_t *pgdir = mm->pgdir = boot_pgdir;
+    assert(pgdir[1] == 0);
+
+    uintptr_t start = PTSIZE, end = PTSIZE + 8 * PGSIZE, la;
+    assert(mm_map(mm, start, end - start, VM_READ | VM_WRITE, NULL) == 0);
+    assert(mm_populate(mm, start, end) == 0);
+    for (la = start; la < end; la += PGSIZE) {
+        pte_t *ptep = get_pte(pgdir, la, 0);
+        assert(ptep != NULL && (*ptep & PTE_W) && *(int *)la == 0);
+    }
+
+    // read only in the middle: three vmas, the PTEs lose PTE_W at once
+    assert(mm_protect(mm, start + 2 * PGSIZE, 2 * PGSIZE, 0) == 0);
+    assert(mm->map_count == 3 && !(find_vma(mm, start + 3 * PGSIZE)->vm_flags & VM_WRITE));
+    assert(!(*get_pte(pgdir, start + 2 * PGSIZE, 0) & PTE_W) && (*get_pte(pgdir, start + PGSIZE, 0) & PTE_W));
+    assert(mm_protect(mm, end - PGSIZE, 2 * PGSIZE, 0) == -E_INVAL);
+
+    // writable again: the vmas merge back, a write sets PTE_W in place
+    assert(mm_protect(mm, start + 2 * PGSIZE, 2 * PGSIZE, 1) == 0);
+    assert(mm->map_count == 1 && find_vma(mm, start + 3 * PGSIZE)->vm_start == start);
+    struct Page *page = get_page(pgdir, start + 2 * PGSIZE, NULL);
+    *(char *)(start + 2 * PGSIZE) = 2;
+    assert(get_page(pgdir, start + 2 * PGSIZE, NULL) == page && (*get_pte(pgdir, start + 2 * PGSIZE, 0) & PTE_W));
+
+    // at MAX_MAP_COUNT a cut in the middle is refused with nothing changed,
+    // the whole vma changes in place
+    int map_count = mm->map_count;
+    mm->map_count = MAX_MAP_COUNT;
+    assert(mm_protect(mm, start + 2 * PGSIZE, 2 * PGSIZE, 0) == -E_NO_MEM);
+    assert(find_vma(mm, start + 3 * PGSIZE)->vm_start == start && (*get_pte(pgdir, start + 2 * PGSIZE, 0) & PTE_W));
+    assert(mm_protect(mm, start, end - start, 0) == 0 && mm->map_count == MAX_MAP_COUNT);
+    assert(mm_protect(mm, start, end - start, 1) == 0 && mm->map_count == MAX_MAP_COUNT);
+    mm->map_count = map_count;
+
+    exit_range(pgdir, start, PTSIZE * 2);
+    assert(pgdir[1] == 0);
+
+    mm->pgdir = NULL;
+    mm_destroy(mm);
+    check_mm_struct = NULL;
+
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_mm_protect() succeeded!\n");
+}
 //page fault number
 volatile unsigned int pgfault_num=0;
 
+// vma_alloc_page - get a page for la in vma and map it in pgdir with perm. a page of
+//                - an image backed vma is filled from the image, whatever part of it
+//                - is outside [vm_image_start, vm_image_end) is zero, e.g. the BSS.
+//                - a read only page that is a whole page aligned frame of the image
+//                - is mapped as it is, with no copy, every process shares it.
+//                - a read (!write) of a page that is all zero maps zero_page read only.
+static struct Page *
+vma_alloc_page(pde_t *pgdir, struct vma_struct *vma, uintptr_t la, uint32_t perm, bool write) {
+    uintptr_t start = vma->vm_image_start, end = vma->vm_image_end;
+    if (vma->vm_image == NULL || end <= la || la + PGSIZE <= start) {
+        if (!write) {
+            return (page_insert(pgdir, zero_page, la, perm & ~PTE_W) == 0) ? zero_page : NULL;
+        }
+        return pgdir_alloc_page(pgdir, la, perm);
+    }
+    struct Page *page;
+    unsigned char *image = vma->vm_image + (la - start);
+    if (!(vma->vm_flags & VM_WRITE) && start <= la && la + PGSIZE <= end
+        && (uintptr_t)image % PGSIZE == 0) {
+        // a reserved frame: never freed or swapped, and always copied on write
+        page = kva2page(image);
+        assert(PageReserved(page));
+        return (page_insert(pgdir, page, la, perm) == 0) ? page : NULL;
+    }
+    if ((page = alloc_page()) == NULL) {
+        return NULL;
+    }
+    void *kva = page2kva(page);
+    size_t off = (start > la) ? start - la : 0;
+    size_t size = ((end < la + PGSIZE) ? end - la : PGSIZE) - off;
+    memset(kva, 0, off);
+    memcpy(kva + off, vma->vm_image + (la + off - start), size);
+    memset(kva + off + size, 0, PGSIZE - off - size);
+    if (page_insert(pgdir, page, la, perm) != 0) {
+        free_page(page);
+        return NULL;
+    }
+    return page;
+}
+
+// the # of pages in the window that do_pgfault fills at once, 0 or 1 turns fault around off
+unsigned int fault_around_pages = FAULT_AROUND_PAGES;
+
+// fault_around - after a fault at addr, map the fresh and the swapped out pages of the
+//              - aligned fault_around_pages window around addr, inside vma and the
+//              - page table of addr. the pages are only a guess, so it gives up when
+//              - free memory is down to low_free_pages rather than reclaim for them.
+//              - like addr itself, the fresh pages around a read get zero_page.
+static void
+fault_around(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, uint32_t perm, bool write) {
+    if (fault_around_pages <= 1) {
+        return;
+    }
+    uintptr_t size = fault_around_pages * PGSIZE, pt_start = ROUNDDOWN(addr, PTSIZE);
+    uintptr_t start = ROUNDDOWN(addr, size), end = start + size;
+    if (start < vma->vm_start) {
+        start = vma->vm_start;
+    }
+    if (start < pt_start) {
+        start = pt_start;
+    }
+    if (end > vma->vm_end) {
+        end = vma->vm_end;
+    }
+    if (end > pt_start + PTSIZE) {
+        end = pt_start + PTSIZE;
+    }
+
+    uintptr_t la;
+    pte_t *ptep = get_pte(mm->pgdir, start, 0);
+    for (la = start; la < end; la += PGSIZE, ptep ++) {
+        if (la == addr || (*ptep & PTE_P)) {
+            continue;
+        }
+        if (nr_free_pages() <= low_free_pages) {
+            break;
+        }
+        struct Page *page = NULL;
+        int swap_in_page = (*ptep != 0);
+        if (!swap_in_page) {
+            if ((page = vma_alloc_page(mm->pgdir, vma, la, perm, write)) == NULL) {
+                break;
+            }
+        }
+        else {
+            if (!swap_init_ok || swap_in(mm, la, &page) != 0) {
+                break;
+            }
+            page_insert(mm->pgdir, page, la, perm);
+        }
+        if (swap_init_ok) {
+            swap_map_swappable(mm, la, page, swap_in_page);
+        }
+        mm->nr_fault_around ++;
+    }
+}
+
+// huge_fault - map the aligned 4MB around addr with one 4MB page, when all of it is
+//            - anonymous memory of vma with nothing mapped yet, and an aligned block of
+//            - NPTEENTRY pages is free. return 0 if it is mapped, or addr is left to
+//            - the 4KB pages as usual. only write faults and mm_populate get here.
+static int
+huge_fault(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, uint32_t perm) {
+    // without CR4.PSE the MMU would read the 4MB page as a page table, and
+    // only the buddy manager hands out blocks aligned to their size: others
+    // would alloc and free 4MB on every fault for nothing
+    if (!pse_enabled() || pmm_manager != &buddy_pmm_manager) {
+        return -E_INVAL;
+    }
+    uintptr_t la = ROUNDDOWN(addr, PTSIZE);
+    pde_t *pdep = &mm->pgdir[PDX(la)];
+    if (*pdep != 0 || vma->vm_image != NULL || la < vma->vm_start || vma->vm_end - la < PTSIZE
+        || !USER_ACCESS(la, la + PTSIZE) || nr_free_pages() < low_free_pages + NPTEENTRY) {
+        return -E_INVAL;
+    }
+    // a 4MB page is only worth it when one is free already, alloc_pages would
+    // empty the page cache and zero_pool or init memmap sections to make one
+    struct Page *page;
+    if ((page = alloc_pages_nowait(NPTEENTRY)) == NULL) {
+        return -E_NO_MEM;
+    }
+    if (page2pa(page) % PTSIZE != 0) {
+        free_pages(page, NPTEENTRY);
+        return -E_INVAL;
+    }
+    int i;
+    for (i = 0; i < NPTEENTRY; i ++) {
+        set_page_ref(page + i, 1);
+    }
+    memset(page2kva(page), 0, PTSIZE);
+    *pdep = page2pa(page) | PTE_PS | PTE_P | perm;
+    if (swap_init_ok) {
+        swap_map_swappable(mm, la, page, 0);
+    }
+    mm->nr_huge_fault ++;
+    return 0;
+}
+
+// huge_reuse - a write to a 4MB page that fork write protected: if no other process
+//            - maps any of its pages any more, it is made writable in place
+static bool
+huge_reuse(struct mm_struct *mm, uintptr_t addr) {
+    pde_t *pdep = &mm->pgdir[PDX(addr)];
+    struct Page *page = pa2page(PDE_PS_ADDR(*pdep));
+    int i;
+    for (i = 0; i < NPTEENTRY; i ++) {
+        if (page_ref(page + i) > 1) {
+            return 0;
+        }
+    }
+    *pdep |= PTE_W;
+    tlb_invalidate(mm->pgdir, addr);
+    return 1;
+}
+
 /* do_pgfault - interrupt handler to process the page fault execption
  * @mm         : the control struct for a set of vma using the same PDT
  * @error_code : the error code recorded in trapframe->tf_err which is setted by x86 hardware
@@ -391,6 +1431,10 @@ volatile unsigned int pgfault_num=0;
 int
 do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
     int ret = -E_INVAL;
+    //an allocation below may reclaim right away (swap_balance), and swap_reclaim
+    //skips a locked mm: the pages this fault works on must stay where they are.
+    //a syscall of this process holding the lock (e.g. do_mmap) has it skipped too.
+    bool locked = try_lock(&(mm->mm_lock));
     //try to find a vma which include addr
     struct vma_struct *vma = find_vma(mm, addr);
 
@@ -400,6 +1444,7 @@ do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
         cprintf("not valid addr %x, and  can not find it in vma\n", addr);
         goto failed;
     }
+    mm->nr_pgfault ++;
     //check the error_code
     switch (error_code & 3) {
     default:
@@ -493,6 +1538,18 @@ do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
         }
    }
 #endif
+    if(pde_huge(mm->pgdir[PDX(addr)])){//only a write to a 4MB page that fork write protected gets here
+        if(huge_reuse(mm,addr)){
+            goto done;
+        }
+        if(huge_split(mm->pgdir,addr)!=0){//still shared: the 4KB page is copied on write below
+            goto failed;
+        }
+    }
+    else if((error_code&2)&&huge_fault(mm,vma,addr,perm)==0){//a read maps zero_page, not 4MB of fresh memory
+        goto done;
+    }
+    bool pt_shared=pde_shared(mm->pgdir[PDX(addr)]);//get_pte copies a page table shared since fork
     ptep=get_pte(mm->pgdir,addr,1);//获取ptep
     //get_pte:获得一个pte并返回这个pte的内核虚拟地址，如果这个pte不存在，则为PT分配一个页面
     //(1) try to find a pte, if pte's PT(Page Table) isn't existed, then create a PT.
@@ -500,10 +1557,15 @@ do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
     if(ptep==NULL){
         goto failed;//若pte不存在且分配页面失败则跳转至failed部分返回ret
     }
+    if(pt_shared&&swap_init_ok){
+        //the pages of the page table may have left the swap queues when another process dropped it
+        swap_map_range(mm,ROUNDDOWN(addr,PTSIZE),ROUNDDOWN(addr,PTSIZE)+PTSIZE);
+    }
     if(*ptep==0){//如果是上述新创建的二级页表，那么*ptep就为0，代表页表为空。
     //此时需调用pgdir_alloc_page，对它进行初始化
     //若PTE所指向的物理页表地址不存在，则分配一个物理页并将逻辑地址和物理地址作映射(即让PTE指向物理页帧)
-    	if(pgdir_alloc_page(mm->pgdir,addr,perm)==NULL){
+    	struct Page *page=vma_alloc_page(mm->pgdir,vma,addr,perm,error_code&2);//an image backed vma is filled from its image
+    	if(page==NULL){
             //调用alloc_page和page_insert函数来分配一个页面大小的内存，并用线性地址addr和mm->pgdir来设置一个映射关系mm->pgdir<--->addr
             //perm设置物理页权限，保证与其对应的虚拟页的权限一致
             //分配物理页，并与对应的虚拟页建立映射关系
@@ -511,6 +1573,34 @@ do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
             //所以对于(2)的英文注释，调用pgdir_alloc_page函数即可
             goto failed;//分配或映射失败则跳转至failed部分返回ret
         }
+        if(swap_init_ok){
+            swap_map_swappable(mm,addr,page,0);//新分配的页可被kswapd换出
+        }
+        fault_around(mm,vma,addr,perm,error_code&2);
+    }
+    else if(*ptep&PTE_P){//write to a present read only pte in a writable vma: copy on write
+        struct Page *page=pte2page(*ptep);
+        if(page_ref(page)>1||PageReserved(page)){//still shared with another mm (or the kernel), give this one its own copy
+            struct Page *npage=(page==zero_page)?alloc_zeroed_page():alloc_page();
+            if(npage==NULL){
+                goto failed;
+            }
+            if(page!=zero_page){
+                memcpy(page2kva(npage),page2kva(page),PGSIZE);
+            }
+            if(page_insert(mm->pgdir,npage,addr,perm)!=0){
+                free_page(npage);
+                goto failed;
+            }
+            page=npage;
+        }
+        else{//the other mappings are gone, the page can be written in place
+            *ptep|=PTE_W;
+            tlb_invalidate(mm->pgdir,addr);
+        }
+        if(swap_init_ok){
+            swap_map_swappable(mm,addr,page,0);
+        }
     }
     else{//若*ptep!=0,则代表pa不为空，即页表项不为空，于是准备向内存中换入该页
         if(swap_init_ok){//代表初始化成功
@@ -524,15 +1614,152 @@ do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr) {
             //(2) According to the mm, addr AND page, setup the map of phy addr <---> logical addr
             swap_map_swappable(mm,addr,page,1); //将该页设置为可交换 
             //(3) make the page swappable.
-            page->pra_vaddr=addr;//设置页对应的虚拟地址
+            fault_around(mm,vma,addr,perm,error_code&2);
         }
         else{//若初始化失败
             cprintf("no swap_init_ok but ptep is %x, failed\n",*ptep);
             goto failed;//跳转至failed部分并返回ret
         }
     } 
+done:
     ret = 0;
 failed:
+    if (locked) {
+        unlock(&(mm->mm_lock));
+    }
+    return ret;
+}
+
+// mm_populate - map all of [start, end) of an anonymous vma of mm now, so that the first
+//             - accesses don't fault. nothing may be mapped there yet, e.g. right after
+//             - mm_map. an aligned 4MB is tried as a 4MB page, the rest is mapped
+//             - POPULATE_BATCH zeroed pages at a time with pgdir_alloc_pages_bulk.
+//             - on failure the pages mapped so far stay, the caller unmaps the range.
+int
+mm_populate(struct mm_struct *mm, uintptr_t start, uintptr_t end) {
+    struct vma_struct *vma = find_vma(mm, start);
+    assert(vma != NULL && end <= vma->vm_end && vma->vm_image == NULL);
+    uint32_t perm = PTE_U;
+    if (vma->vm_flags & VM_WRITE) {
+        perm |= PTE_W;
+    }
+    struct Page *store[POPULATE_BATCH];
+    int ret;
+    while (start < end) {
+        if (start % PTSIZE == 0 && end - start >= PTSIZE && huge_fault(mm, vma, start, perm) == 0) {
+            start += PTSIZE;
+            continue;
+        }
+        uintptr_t pt_end = ROUNDDOWN(start + PTSIZE, PTSIZE);
+        size_t i, n = ((pt_end < end) ? pt_end : end) - start;
+        n = (n / PGSIZE < POPULATE_BATCH) ? n / PGSIZE : POPULATE_BATCH;
+        if ((ret = pgdir_alloc_pages_bulk(mm->pgdir, start, n, perm, store)) != 0) {
+            return ret;
+        }
+        for (i = 0; i < n; i ++, start += PGSIZE) {
+            memset(page2kva(store[i]), 0, PGSIZE);
+            if (swap_init_ok) {
+                swap_map_swappable(mm, start, store[i], 0);
+            }
+        }
+    }
+    return 0;
+}
+
+// do_mmap - SYS_mmap: map len bytes of anonymous memory at *addr_store, or where
+//         - get_unmapped_area finds room if it is 0, and store the address there.
+//         - with MMAP_POPULATE all pages are mapped before it returns, or the
+//         - range is unmapped again with the error.
+int
+do_mmap(uintptr_t *addr_store, size_t len, uint32_t mmap_flags) {
+    struct mm_struct *mm = current->mm;
+    if (mm == NULL) {
+        panic("kernel thread call mmap!!.\n");
+    }
+    if (addr_store == NULL || len == 0) {
+        return -E_INVAL;
+    }
+
+    int ret = -E_INVAL;
+
+    uintptr_t addr;
+
+    lock_mm(mm);
+    if (!copy_from_user(mm, &addr, addr_store, sizeof(uintptr_t), 1)) {
+        goto out_unlock;
+    }
+
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = addr + len;
+    addr = start, len = ROUNDUP(end, PGSIZE) - start;
+
+    uint32_t vm_flags = VM_READ;
+    if (mmap_flags & MMAP_WRITE) vm_flags |= VM_WRITE;
+    if (mmap_flags & MMAP_STACK) vm_flags |= VM_STACK;
+
+    ret = -E_NO_MEM;
+    if (addr == 0) {
+        if ((addr = get_unmapped_area(mm, len)) == 0) {
+            goto out_unlock;
+        }
+    }
+    // the address is stored first, so that nothing is mapped when it can't be
+    ret = -E_INVAL;
+    if (!copy_to_user(mm, addr_store, &addr, sizeof(uintptr_t))) {
+        goto out_unlock;
+    }
+    if ((ret = mm_map(mm, addr, len, vm_flags, NULL)) != 0) {
+        goto out_unlock;
+    }
+    if ((mmap_flags & MMAP_POPULATE) && (ret = mm_populate(mm, addr, addr + len)) != 0) {
+        // mm_map may have merged the range into a neighbour, and cutting it out
+        // again can fail too (no memory for a page table or a vma). then the
+        // range stays mapped and faults in as if MMAP_POPULATE wasn't given.
+        if (mm_unmap(mm, addr, len) != 0) {
+            ret = 0;
+        }
+    }
+
+out_unlock:
+    unlock_mm(mm);
+    return ret;
+}
+
+// do_munmap - SYS_munmap: unmap [addr, addr + len) of the current process
+int
+do_munmap(uintptr_t addr, size_t len) {
+    struct mm_struct *mm = current->mm;
+    if (mm == NULL) {
+        panic("kernel thread call munmap!!.\n");
+    }
+    if (len == 0) {
+        return -E_INVAL;
+    }
+    int ret;
+    lock_mm(mm);
+    {
+        ret = mm_unmap(mm, addr, len);
+    }
+    unlock_mm(mm);
+    return ret;
+}
+
+// do_mprotect - SYS_mprotect: make [addr, addr + len) writable if mmap_flags has
+//             - MMAP_WRITE, read only otherwise
+int
+do_mprotect(uintptr_t addr, size_t len, uint32_t mmap_flags) {
+    struct mm_struct *mm = current->mm;
+    if (mm == NULL) {
+        panic("kernel thread call mprotect!!.\n");
+    }
+    if (len == 0) {
+        return -E_INVAL;
+    }
+    int ret;
+    lock_mm(mm);
+    {
+        ret = mm_protect(mm, addr, len, (mmap_flags & MMAP_WRITE) != 0);
+    }
+    unlock_mm(mm);
     return ret;
 }
 
@@ -5,9 +5,11 @@
 #include <list.h>
 #include <memlayout.h>
 #include <sync.h>
+#include <rb_tree.h>
 
 //pre define
 struct mm_struct;
+struct anon_vma;
 
 // the virtual continuous memory area(vma), [vm_start, vm_end), 
 // addr belong to a vma means  vma.vm_start<= addr <vma.vm_end 
@@ -16,31 +18,62 @@ struct vma_struct {
     uintptr_t vm_start;      // start addr of vma      
     uintptr_t vm_end;        // end addr of vma, not include the vm_end itself
     uint32_t vm_flags;       // flags of vma
+    rb_node rb_link;         // redblack link which sorted by start addr of vma
+    uintptr_t vm_gap_max;    // the largest hole below a vma in the redblack subtree of this vma
+    unsigned char *vm_image; // the image (e.g. an ELF binary) pages are filled from on demand, NULL if anonymous
+    uintptr_t vm_image_start;// [vm_image_start, vm_image_end) is read from vm_image, the rest is zero
+    uintptr_t vm_image_end;
     list_entry_t list_link;  // linear list link which sorted by start addr of vma
 };
 
 #define le2vma(le, member)                  \
     to_struct((le), struct vma_struct, member)
 
+#define rbn2vma(node, member)               \
+    to_struct((node), struct vma_struct, member)
+
 #define VM_READ                 0x00000001
 #define VM_WRITE                0x00000002
 #define VM_EXEC                 0x00000004
 #define VM_STACK                0x00000008
 
+#define RB_MIN_MAP_COUNT        32 // If the count of vma >32 then redblack tree link is used
+#define MAX_MAP_COUNT           4096 // mm_map, mm_brk and a splitting mm_unmap fail with more vmas than this
+#define POPULATE_BATCH          16 // pages mm_populate maps per pgdir_alloc_pages_bulk
+
+// mmap_flags of SYS_mmap and SYS_mprotect
+#ifndef MMAP_WRITE
+#define MMAP_WRITE              0x100
+#define MMAP_STACK              0x200
+#endif
+#define MMAP_POPULATE           0x400 // map every page before SYS_mmap returns, no faults later
+#define FAULT_AROUND_PAGES      16 // the default window of pages do_pgfault maps at once, a power of 2
+
 // the control struct for a set of vma using the same PDT
 struct mm_struct {
     list_entry_t mmap_list;        // linear list link which sorted by start addr of vma
+    rb_tree *mmap_tree;            // redblack tree link which sorted by start addr of vma
     struct vma_struct *mmap_cache; // current accessed vma, used for speed purpose
     pde_t *pgdir;                  // the PDT of these vma
     int map_count;                 // the count of these vma
     void *sm_priv;                 // the private data for swap manager
+    list_entry_t pra_list_head;    // the swappable pages of this mm, kept in order by swap manager
     int mm_count;                  // the number ofprocess which shared the mm
+    unsigned int nr_pgfault;       // the # of page faults handled for this mm
+    unsigned int nr_fault_around;  // the # of pages mapped ahead by fault around, i.e. faults saved
+    unsigned int nr_huge_fault;    // the # of faults mapped with a 4MB page
+    unsigned int nr_vma_merge;     // the # of vmas merged into a neighbour instead of added
     lock_t mm_lock;                // mutex for using dup_mmap fun to duplicat the mm
+    struct anon_vma *anon_vma;     // the fork family of this mm, see rmap.h
+    list_entry_t anon_link;        // link in the mm_list of anon_vma
 };
 
+#define le2mm(le, member)                   \
+    to_struct((le), struct mm_struct, member)
+
 struct vma_struct *find_vma(struct mm_struct *mm, uintptr_t addr);
 struct vma_struct *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t vm_flags);
-void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma);
+struct vma_struct *insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma);
 
 struct mm_struct *mm_create(void);
 void mm_destroy(struct mm_struct *mm);
@@ -55,14 +88,28 @@ int dup_mmap(struct mm_struct *to, struct mm_struct *from);
 void exit_mmap(struct mm_struct *mm);
 uintptr_t get_unmapped_area(struct mm_struct *mm, size_t len);
 int mm_brk(struct mm_struct *mm, uintptr_t addr, size_t len);
+int mm_protect(struct mm_struct *mm, uintptr_t addr, size_t len, bool write);
+int mm_populate(struct mm_struct *mm, uintptr_t start, uintptr_t end);
+int do_mmap(uintptr_t *addr_store, size_t len, uint32_t mmap_flags);
+int do_munmap(uintptr_t addr, size_t len);
+int do_mprotect(uintptr_t addr, size_t len, uint32_t mmap_flags);
 
 extern volatile unsigned int pgfault_num;
+extern unsigned int fault_around_pages;
+extern struct Page *zero_page;
 extern struct mm_struct *check_mm_struct;
 
 bool user_mem_check(struct mm_struct *mm, uintptr_t start, size_t len, bool write);
 bool copy_from_user(struct mm_struct *mm, void *dst, const void *src, size_t len, bool writable);
 bool copy_to_user(struct mm_struct *mm, void *dst, const void *src, size_t len);
 
+// an instruction that may fault on a user address, and where to resume if it does
+struct exception_table_entry {
+    uintptr_t insn, fixup;
+};
+
+uintptr_t search_exception_table(uintptr_t eip);
+
 static inline int
 mm_count(struct mm_struct *mm) {
     return mm->mm_count;
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <swap.h>
 
 /* ------------- process/thread mechanism design&implementation -------------
 (an simplified Linux process/thread mechanism )
@@ -69,6 +70,18 @@ list_entry_t proc_list;
 // has list for process set based on pid
 static list_entry_t hash_list[HASH_LIST_SIZE];
 
+// the page aligned copies of the binaries that load_icode has run, see binary_aligned
+struct binary_copy {
+    unsigned char *binary;      // the binary, as passed to do_execve
+    unsigned char *copy;        // its page aligned copy, in reserved pages that are never freed
+    list_entry_t link;
+};
+
+#define le2binary(le, member)               \
+    to_struct((le), struct binary_copy, member)
+
+static list_entry_t binary_copy_list;
+
 // idle proc
 struct proc_struct *idleproc = NULL;
 // init proc
@@ -309,6 +322,8 @@ setup_pgdir(struct mm_struct *mm) {
 static void
 put_pgdir(struct mm_struct *mm) {
     free_page(kva2page(mm->pgdir));
+    // rmap_walk skips an mm without page table until mm_destroy takes it off its family
+    mm->pgdir = NULL;
 }
 
 // copy_mm - process "proc" duplicate OR share process "current"'s mm according clone_flags
@@ -478,6 +493,43 @@ do_exit(int error_code) {
     panic("do_exit will not return!! %d.\n", current->pid);
 }
 
+// binary_aligned - do_pgfault maps the read only pages of a program straight from the
+//                - frames of its binary, which works only if the binary is page aligned.
+//                - the binaries embedded in the kernel aren't, so the first exec of one
+//                - makes a page aligned copy that every later exec of it maps from.
+//                - if there is no memory for it, the binary itself is used.
+static unsigned char *
+binary_aligned(unsigned char *binary, size_t size) {
+    if ((uintptr_t)binary % PGSIZE == 0) {
+        return binary;
+    }
+    list_entry_t *le = &binary_copy_list;
+    while ((le = list_next(le)) != &binary_copy_list) {
+        struct binary_copy *bc = le2binary(le, link);
+        if (bc->binary == binary) {
+            return bc->copy;
+        }
+    }
+
+    struct binary_copy *bc;
+    struct Page *base;
+    size_t i, n = ROUNDUP(size, PGSIZE) / PGSIZE;
+    if ((bc = kmalloc(sizeof(struct binary_copy))) == NULL) {
+        return binary;
+    }
+    if ((base = alloc_pages(n)) == NULL) {
+        kfree(bc);
+        return binary;
+    }
+    for (i = 0; i < n; i ++) {
+        SetPageReserved(base + i);
+    }
+    bc->binary = binary, bc->copy = page2kva(base);
+    memcpy(bc->copy, binary, size);
+    list_add(&binary_copy_list, &(bc->link));
+    return bc->copy;
+}
+
 /* load_icode - load the content of binary program(ELF format) as the new content of current process
  * @binary:  the memory addr of the content of binary program
  * @size:  the size of the content of binary program
@@ -498,8 +550,7 @@ load_icode(unsigned char *binary, size_t size) {
     if (setup_pgdir(mm) != 0) {
         goto bad_pgdir_cleanup_mm;
     }
-    //(3) copy TEXT/DATA section, build BSS parts in binary to memory space of process
-    struct Page *page;
+    //(3) map TEXT/DATA section and BSS parts in binary to memory space of process
     //(3.1) get the file header of the bianry program (ELF format)
     struct elfhdr *elf = (struct elfhdr *)binary;
     //(3.2) get the entry of the program section headers of the bianry program (ELF format)
@@ -509,8 +560,12 @@ load_icode(unsigned char *binary, size_t size) {
         ret = -E_INVAL_ELF;
         goto bad_elf_cleanup_pgdir;
     }
+    //(3.3.1) the vmas refer to a page aligned copy of the binary, so that text is shared
+    binary = binary_aligned(binary, size);
+    elf = (struct elfhdr *)binary;
+    ph = (struct proghdr *)(binary + elf->e_phoff);
 
-    uint32_t vm_flags, perm;
+    uint32_t vm_flags;
     struct proghdr *ph_end = ph + elf->e_phnum;
     for (; ph < ph_end; ph ++) {
     //(3.4) find every program section headers
@@ -524,72 +579,38 @@ load_icode(unsigned char *binary, size_t size) {
         if (ph->p_filesz == 0) {
             continue ;
         }
+        if (ph->p_offset > size || ph->p_filesz > size - ph->p_offset) {
+            ret = -E_INVAL_ELF;
+            goto bad_cleanup_mmap;
+        }
     //(3.5) call mm_map fun to setup the new vma ( ph->p_va, ph->p_memsz)
-        vm_flags = 0, perm = PTE_U;
+        vm_flags = 0;
         if (ph->p_flags & ELF_PF_X) vm_flags |= VM_EXEC;
         if (ph->p_flags & ELF_PF_W) vm_flags |= VM_WRITE;
         if (ph->p_flags & ELF_PF_R) vm_flags |= VM_READ;
-        if (vm_flags & VM_WRITE) perm |= PTE_W;
-        if ((ret = mm_map(mm, ph->p_va, ph->p_memsz, vm_flags, NULL)) != 0) {
+        struct vma_struct *vma;
+        if ((ret = mm_map(mm, ph->p_va, ph->p_memsz, vm_flags, &vma)) != 0) {
             goto bad_cleanup_mmap;
         }
-        unsigned char *from = binary + ph->p_offset;
-        size_t off, size;
-        uintptr_t start = ph->p_va, end, la = ROUNDDOWN(start, PGSIZE);
-
-        ret = -E_NO_MEM;
-
-     //(3.6) alloc memory, and  copy the contents of every program section (from, from+end) to process's memory (la, la+end)
-        end = ph->p_va + ph->p_filesz;
-     //(3.6.1) copy TEXT/DATA section of bianry program
-        while (start < end) {
-            if ((page = pgdir_alloc_page(mm->pgdir, la, perm)) == NULL) {
-                goto bad_cleanup_mmap;
-            }
-            off = start - la, size = PGSIZE - off, la += PGSIZE;
-            if (end < la) {
-                size -= la - end;
-            }
-            memcpy(page2kva(page) + off, from, size);
-            start += size, from += size;
-        }
-
-      //(3.6.2) build BSS section of binary program
-        end = ph->p_va + ph->p_memsz;
-        if (start < la) {
-            /* ph->p_memsz == ph->p_filesz */
-            if (start == end) {
-                continue ;
-            }
-            off = start + PGSIZE - la, size = PGSIZE - off;
-            if (end < la) {
-                size -= la - end;
-            }
-            memset(page2kva(page) + off, 0, size);
-            start += size;
-            assert((end < la && start == end) || (end >= la && start == la));
-        }
-        while (start < end) {
-            if ((page = pgdir_alloc_page(mm->pgdir, la, perm)) == NULL) {
-                goto bad_cleanup_mmap;
-            }
-            off = start - la, size = PGSIZE - off, la += PGSIZE;
-            if (end < la) {
-                size -= la - end;
-            }
-            memset(page2kva(page) + off, 0, size);
-            start += size;
-        }
+    //(3.6) nothing is copied here, do_pgfault fills a page on its first access:
+    //      TEXT/DATA from (binary + p_offset, binary + p_offset + p_filesz), the BSS with zero
+        vma->vm_image = binary + ph->p_offset;
+        vma->vm_image_start = ph->p_va;
+        vma->vm_image_end = ph->p_va + ph->p_filesz;
     }
     //(4) build user stack memory
     vm_flags = VM_READ | VM_WRITE | VM_STACK;
     if ((ret = mm_map(mm, USTACKTOP - USTACKSIZE, USTACKSIZE, vm_flags, NULL)) != 0) {
         goto bad_cleanup_mmap;
     }
-    assert(pgdir_alloc_page(mm->pgdir, USTACKTOP-PGSIZE , PTE_USER) != NULL);
-    assert(pgdir_alloc_page(mm->pgdir, USTACKTOP-2*PGSIZE , PTE_USER) != NULL);
-    assert(pgdir_alloc_page(mm->pgdir, USTACKTOP-3*PGSIZE , PTE_USER) != NULL);
-    assert(pgdir_alloc_page(mm->pgdir, USTACKTOP-4*PGSIZE , PTE_USER) != NULL);
+    struct Page *stack[4];
+    assert(pgdir_alloc_pages_bulk(mm->pgdir, USTACKTOP-4*PGSIZE, 4, PTE_USER, stack) == 0);
+    if (swap_init_ok) {
+        int i;
+        for (i = 0; i < 4; i ++) {
+            swap_map_swappable(mm, USTACKTOP-(4-i)*PGSIZE, stack[i], 0);
+        }
+    }
     
     //(5) set current process's mm, sr3, and set CR3 reg = physical addr of Page Directory
     mm_count_inc(mm);
@@ -637,16 +658,15 @@ bad_mm:
 int
 do_execve(const char *name, size_t len, unsigned char *binary, size_t size) {
     struct mm_struct *mm = current->mm;
-    if (!user_mem_check(mm, (uintptr_t)name, len, 0)) {
-        return -E_INVAL;
-    }
     if (len > PROC_NAME_LEN) {
         len = PROC_NAME_LEN;
     }
 
     char local_name[PROC_NAME_LEN + 1];
     memset(local_name, 0, sizeof(local_name));
-    memcpy(local_name, name, len);
+    if (!copy_from_user(mm, local_name, name, len, 0)) {
+        return -E_INVAL;
+    }
 
     if (mm != NULL) {
         lcr3(boot_cr3);
@@ -682,12 +702,6 @@ do_yield(void) {
 int
 do_wait(int pid, int *code_store) {
     struct mm_struct *mm = current->mm;
-    if (code_store != NULL) {
-        if (!user_mem_check(mm, (uintptr_t)code_store, sizeof(int), 1)) {
-            return -E_INVAL;
-        }
-    }
-
     struct proc_struct *proc;
     bool intr_flag, haskid;
 repeat:
@@ -726,7 +740,10 @@ found:
         panic("wait idleproc or initproc.\n");
     }
     if (code_store != NULL) {
-        *code_store = proc->exit_code;
+        // a bad code_store leaves the zombie for the next wait
+        if (!copy_to_user(mm, code_store, &(proc->exit_code), sizeof(int))) {
+            return -E_INVAL;
+        }
     }
     local_intr_save(intr_flag);
     {
@@ -805,6 +822,7 @@ init_main(void *arg) {
     size_t nr_free_pages_store = nr_free_pages();
     size_t kernel_allocated_store = kallocated();
 
+    memmap_init_deferred();
     int pid = kernel_thread(user_main, NULL, 0);
     if (pid <= 0) {
         panic("create user_main failed.\n");
@@ -816,8 +834,9 @@ init_main(void *arg) {
 
     cprintf("all user-mode processes have quit.\n");
     assert(initproc->cptr == NULL && initproc->yptr == NULL && initproc->optr == NULL);
-    assert(nr_process == 2);
-    assert(list_next(&proc_list) == &(initproc->list_link));
+    // kswapd, created by swap_init after initproc, never exits
+    assert(nr_process == ((kswapd != NULL) ? 3 : 2));
+    assert(list_next(&proc_list) == &(((kswapd != NULL) ? kswapd : initproc)->list_link));
     assert(list_prev(&proc_list) == &(initproc->list_link));
 
     cprintf("init check memory pass.\n");
@@ -834,6 +853,7 @@ proc_init(void) {
     for (i = 0; i < HASH_LIST_SIZE; i ++) {
         list_init(hash_list + i);
     }
+    list_init(&binary_copy_list);
 
     if ((idleproc = alloc_proc()) == NULL) {
         panic("cannot alloc idleproc.\n");
@@ -861,12 +881,16 @@ proc_init(void) {
 }
 
 // cpu_idle - at the end of kern_init, the first kernel thread idleproc will do below works
+//          - while nothing else wants the CPU, it clears free pages for alloc_zeroed_page
 void
 cpu_idle(void) {
     while (1) {
         if (current->need_resched) {
             schedule();
         }
+        else {
+            zero_pool_refill();
+        }
     }
 }
 
@@ -69,6 +69,7 @@ struct proc_struct {
 #define PF_EXITING                  0x00000001      // getting shutdown
 
 #define WT_CHILD                    (0x00000001 | WT_INTERRUPTED)
+#define WT_KSWAPD                    0x00000002                    // kswapd waits for free pages to drop below the low watermark
 #define WT_INTERRUPTED               0x80000000                    // the wait state could be interrupted
 
 
@@ -4,9 +4,15 @@
 #include <trap.h>
 #include <stdio.h>
 #include <pmm.h>
+#include <vmm.h>
 #include <assert.h>
 #include <clock.h>
 
+// unistd.h has SYS_mmap and SYS_munmap, mprotect comes next
+#ifndef SYS_mprotect
+#define SYS_mprotect        23
+#endif
+
 static int
 sys_exit(uint32_t arg[]) {
     int error_code = (int)arg[0];
@@ -69,6 +75,29 @@ static int
 sys_gettime(uint32_t arg[]) {
     return (int)ticks;
 }
+static int
+sys_mmap(uint32_t arg[]) {
+    uintptr_t *addr_store = (uintptr_t *)arg[0];
+    size_t len = (size_t)arg[1];
+    uint32_t mmap_flags = (uint32_t)arg[2];
+    return do_mmap(addr_store, len, mmap_flags);
+}
+
+static int
+sys_munmap(uint32_t arg[]) {
+    uintptr_t addr = (uintptr_t)arg[0];
+    size_t len = (size_t)arg[1];
+    return do_munmap(addr, len);
+}
+
+static int
+sys_mprotect(uint32_t arg[]) {
+    uintptr_t addr = (uintptr_t)arg[0];
+    size_t len = (size_t)arg[1];
+    uint32_t mmap_flags = (uint32_t)arg[2];
+    return do_mprotect(addr, len, mmap_flags);
+}
+
 static int
 sys_lab6_set_priority(uint32_t arg[])
 {
@@ -88,6 +117,9 @@ static int (*syscalls[])(uint32_t arg[]) = {
     [SYS_putc]              sys_putc,
     [SYS_pgdir]             sys_pgdir,
     [SYS_gettime]           sys_gettime,
+    [SYS_mmap]              sys_mmap,
+    [SYS_munmap]            sys_munmap,
+    [SYS_mprotect]          sys_mprotect,
     [SYS_lab6_set_priority] sys_lab6_set_priority,
 };
 
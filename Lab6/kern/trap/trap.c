@@ -196,6 +196,12 @@ trap_dispatch(struct trapframe *tf) {
     switch (tf->tf_trapno) {
     case T_PGFLT:  //page fault
         if ((ret = pgfault_handler(tf)) != 0) {
+            uintptr_t fixup;
+            if (trap_in_kernel(tf) && (fixup = search_exception_table(tf->tf_eip)) != 0) {
+                // a user copy hit a bad address, let it fail
+                tf->tf_eip = fixup;
+                break;
+            }
             print_trapframe(tf);
             if (current == NULL) {
                 panic("handle pgfault failed. ret=%d\n", ret);